@@ -0,0 +1,85 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#include <vector>
+#include <mutex>
+#include <ostream>
+#include <iostream>
+
+struct SolverState;
+
+/** Constraint of the solution violated at the end of a run */
+struct ConstraintViolation {
+    int vehicle;                                                        /** vehicle of the constraint */
+    int other;                                                          /** other vehicle of a collision constraint, -1 for a lane one */
+    int node;                                                           /** integration node */
+    double value;                                                       /** value of the constraint (target: < 0) */
+};
+
+/** Receiver of the diagnostics of the planner: the iterations of each solve, the trajectories and the violated
+ * constraints of the solution. The planner only computes what the sink asks for, a sink can be shared by the solves
+ * running at the same time. The state trajectories are <X, Y, V, PSI, S, L> and the inputs <d, F> at the N + 1 nodes
+ * of each vehicle */
+class DiagnosticsSink {
+public:
+    virtual ~DiagnosticsSink() {}
+
+    virtual bool wants_trajectories() const { return false; }          /** the planner sends the trajectories */
+    virtual bool wants_violations() const { return false; }            /** the planner checks the constraints of the solution */
+
+    virtual void solve_finished(const SolverState& /*state*/) {}        /** end of the solver: iterations, status and residual */
+    virtual void trajectories(const SolverState& /*state*/, int /*N*/, const double* /*X*/,
+                              const double* /*U*/) {}                   /** trajectories of the solution */
+    virtual void violations(const SolverState& /*state*/,
+                            const std::vector<ConstraintViolation>& /*violations*/) {}  /** violated constraints of the solution */
+    virtual void planner_destroyed() {}                                 /** destruction of the planner */
+};
+
+/** Sink that discards everything, the default of the planner */
+class NullDiagnostics : public DiagnosticsSink {};
+
+/** Sink that writes the diagnostics as text, each call in a single write */
+class TextDiagnostics : public DiagnosticsSink {
+public:
+    explicit TextDiagnostics(std::ostream& out_ = std::cerr) : out(out_) {}
+
+    bool wants_trajectories() const override { return true; }
+    bool wants_violations() const override { return true; }
+
+    void solve_finished(const SolverState& state) override;
+    void trajectories(const SolverState& state, int N, const double* X, const double* U) override;
+    void violations(const SolverState& state, const std::vector<ConstraintViolation>& violations) override;
+    void planner_destroyed() override;
+
+private:
+    std::ostream& out;
+    std::mutex mutex;                                                   /** keeps the writes of concurrent solves whole */
+};
+
+/** Sink that writes the diagnostics as binary records in native byte order. Each record starts with
+ * <int32 type, int32 M, int32 N> followed by:
+ *      solve_record:       int32 iterations, int32 status, double achieved_gradient_norm, double constraint_violation
+ *      trajectory_record:  M * (N + 1) * 6 doubles X, M * (N + 1) * 2 doubles U
+ *      violation_record:   int32 count, then count times <int32 vehicle, int32 other, int32 node, double value> */
+class BinaryDiagnostics : public DiagnosticsSink {
+public:
+    enum RECORDS {solve_record = 1, trajectory_record = 2, violation_record = 3};
+
+    explicit BinaryDiagnostics(std::ostream& out_, bool trajectories_ = true, bool violations_ = true)
+        : out(out_), send_trajectories(trajectories_), send_violations(violations_) {}
+
+    bool wants_trajectories() const override { return send_trajectories; }
+    bool wants_violations() const override { return send_violations; }
+
+    void solve_finished(const SolverState& state) override;
+    void trajectories(const SolverState& state, int N, const double* X, const double* U) override;
+    void violations(const SolverState& state, const std::vector<ConstraintViolation>& violations) override;
+
+private:
+    std::ostream& out;
+    bool send_trajectories;
+    bool send_violations;
+    std::mutex mutex;                                                   /** keeps the records of concurrent solves whole */
+};
+
+#endif // DIAGNOSTICS_H
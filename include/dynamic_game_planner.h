@@ -2,13 +2,186 @@
 #define DYNAMIC_GAME_PLANNER_H
 
 #include <vector>
+#include <memory>
+#include <functional>
 #include <eigen3/Eigen/Dense>
-#include <thread>
 #include <iomanip>
-#include <mutex>
+#include <chrono>
 #include "vehicle_state.h"
+#include "thread_pool.h"
 #include "utils.h"  // Utility functions
+#include "limited_memory_hessian.h"
+#include "solver_stats.h"
+#include "diagnostics.h"
 
+/** Collision avoidance constraints of a vehicle with the vehicle k at the nodes of the window w, stored from row 
+ * in the constraints of the vehicle */
+struct CollisionBlock {
+    int k;                                                              /** other vehicle */
+    int w;                                                              /** window of nodes */
+    int row;                                                            /** first row in the constraints of the vehicle */
+    int partner;                                                        /** first row of the same pair and window in the constraints 
+                                                                            of vehicle k, from the first constraint of all vehicles */
+};
+
+/** Preallocated buffers of a solve. They are sized once for M vehicles and the threads of the pool, then reused by 
+ * every iteration and, if the SolverState is kept, by every run with the same number of vehicles. Each thread has 
+ * its own scratch slice: <dU, dX, constraints_i, weights_i> */
+struct Workspace {
+    int M = -1;                                                         /** number of agents the buffers are sized for */
+    int num_threads = 0;                                                /** number of scratch slices */
+    int scratch_size = 0;                                               /** size of one scratch slice */
+
+    std::vector<double> U;                                              /** solution of run() */
+    std::vector<double> X;                                              /** state trajectory of run() */
+    std::vector<double> constraints;                                    /** constraints of run() */
+    std::vector<int> match;                                             /** vehicles matched for the warm start */
+    std::vector<ConstraintViolation> violations;                        /** violated constraints of run() */
+
+    std::vector<double> gradient;                                       /** trust region: gradient at the current solution */
+    std::vector<double> d_gradient;                                     /** trust region: gradient at the candidate solution */
+    std::vector<double> dU;                                             /** trust region: candidate solution */
+    std::vector<double> dU_;                                            /** trust region: current solution */
+    std::vector<double> dX;                                             /** trust region: candidate state */
+    std::vector<double> dX_;                                            /** trust region: current state */
+    std::vector<double> lagrangian;                                     /** trust region: lagrangian at the current solution */
+    std::vector<double> d_lagrangian;                                   /** trust region: lagrangian at the candidate solution */
+    std::vector<double> tr_constraints;                                 /** trust region: constraints at the current solution */
+    std::vector<double> lagrangian_multipliers;                         /** trust region: updated lagrangian multipliers */
+    std::vector<double> actual_reduction;                               /** trust region: actual reduction for each agent */
+    std::vector<double> predicted_reduction;                            /** trust region: predicted reduction for each agent */
+    std::vector<double> delta;                                          /** trust region: radius for each agent */
+    std::vector<int> subproblem_iterations;                             /** trust region: iterations of the subproblem of each agent */
+    std::vector<int> agent_gradients;                                   /** best response: gradients of each agent in a sweep */
+    std::vector<double> U_response;                                     /** best response: new inputs of each agent in a Jacobi sweep */
+    std::vector<double> H_;                                             /** trust region: Hessian approximation for each agent, nu x nu 
+                                                                            or the storage of a limited-memory Hessian */
+    std::vector<double> s_;                                             /** trust region: step for each agent, nu x 1 */
+    std::vector<double> U_best;                                         /** trust region: best iterate, returned at the deadline */
+
+    std::vector<double> X_gradient;                                     /** gradient: baseline state trajectory */
+    std::vector<double> lagrangian_gradient;                            /** gradient: baseline lagrangian */
+    std::vector<double> constraints_gradient;                           /** gradient: baseline constraints */
+    std::vector<double> cost;                                           /** gradient: cost of each perturbation */
+    std::vector<int> bounds;                                            /** gradient: chunks of perturbations */
+    std::vector<double> positions;                                      /** distance tensor: x of each vehicle at each node, then y */
+    std::vector<double> pair_distances;                                 /** distance tensor: squared distance of the near pairs, in the 
+                                                                            collision rows of the vehicle with the lower index */
+    std::vector<double> reach;                                          /** interaction graph: radius of the reachable set of each vehicle */
+    std::vector<int> members;                                           /** interaction graph: vehicles sorted by component */
+    std::vector<int> component_start;                                   /** interaction graph: vehicles of component c: 
+                                                                            members[component_start[c]] ... members[component_start[c + 1] - 1] */
+    std::vector<int> component_order;                                   /** interaction graph: components from the largest */
+    std::vector<double> boxes;                                          /** broad phase: box of each vehicle in each window */
+    std::vector<CollisionBlock> blocks;                                 /** broad phase: previous collision blocks */
+    std::vector<int> block_start;                                       /** broad phase: previous first block of each vehicle */
+    std::vector<int> constraint_start;                                  /** broad phase: previous first row of each vehicle */
+    std::vector<double> multipliers;                                    /** broad phase: previous lagrangian multipliers */
+    std::vector<double> cache_U;                                        /** evaluation cache: inputs of each entry, nU_ per entry */
+    std::vector<double> cache_X;                                        /** evaluation cache: state trajectory of each entry */
+    std::vector<double> cache_lagrangian;                               /** evaluation cache: lagrangian of each entry, M per entry */
+    std::vector<double> cache_gradient;                                 /** evaluation cache: gradient of each entry, nU_ per entry */
+    std::vector<long> cache_epoch_lagrangian;                           /** evaluation cache: epoch of the lagrangian of each entry, 
+                                                                            -1 if not computed */
+    std::vector<long> cache_epoch_gradient;                             /** evaluation cache: epoch of the gradient of each entry, 
+                                                                            -1 if not computed */
+    std::vector<long> cache_last_use;                                   /** evaluation cache: last use of each entry, -1 if empty */
+    long cache_clock = 0;                                               /** evaluation cache: counter of the uses */
+
+    std::vector<double> scratch;                                        /** per-thread scratch slices */
+
+    double* thread_scratch(int thread) { return scratch.data() + scratch_size * thread; }
+};
+
+/** How the trust region of the last run stopped: at convergence, at the iteration limit or at the deadline of the 
+ * time budget */
+enum SOLVER_STATUS {converged, iteration_limit, deadline_reached};
+
+/** Per-solve state of the dynamic game: everything that changes while the game is solved. 
+ * A solve only writes to its own SolverState, so one planner can serve several solves at the same time. 
+ * Keeping the same SolverState across consecutive runs enables the warm start. */
+struct SolverState {
+    std::vector<const VehicleState*> traffic;                           /** traffic participants of the game, in the vector of 
+                                                                            the run: valid until the run returns */
+    int M;                                                              /** number of agents */ 
+    int nC;                                                             /** total number of inequality constraints */
+    int nC_i;                                                           /** maximum number of inequality constraints for one vehicle */
+    int nG;                                                             /** number of elements in the gradient G */
+    int nX_;                                                            /** number of elements in the state vector X */
+    int nU_;                                                            /** number of elements in the input vector U */
+    double rho;                                                         /** penalty weight */ 
+    Eigen::MatrixXd ul;                                                 /** controls lower bound*/
+    Eigen::MatrixXd uu;                                                 /** controls upper bound*/
+    std::vector<double> lagrangian_multipliers;                         /** lagrangian multipliers*/
+    std::vector<char> near_pairs;                                       /** broad phase: vehicles k and i can collide in the window w 
+                                                                            of nodes, index (M * i + k) * number of windows + w */
+    std::vector<CollisionBlock> blocks;                                 /** collision constraints of the near pairs, sorted by vehicle, 
+                                                                            other vehicle and window */
+    std::vector<int> block_start;                                       /** blocks of vehicle i: block_start[i] ... block_start[i + 1] - 1 */
+    std::vector<int> constraint_start;                                  /** constraints of vehicle i: constraint_start[i] ... 
+                                                                            constraint_start[i + 1] - 1 */
+    std::vector<int> component;                                         /** interaction graph: component of each vehicle */
+    std::vector<SolverState> components;                                /** games of the components solved separately in the last 
+                                                                            run, empty if the vehicles were solved as one game */
+    std::vector<SolverState> coarse;                                    /** state of the coarse level of the run, empty without 
+                                                                            coarse_level. It is kept across runs as this state */
+
+    double time_budget = 0.0;                                           /** time budget of the last run in seconds, 0 without deadline */
+    std::chrono::steady_clock::time_point start_time;                   /** start of the last run */
+    double gradient_time = 0.0;                                         /** longest gradient evaluation of the last run in seconds, 
+                                                                            it estimates the ones of the next run */
+    double output_time = 0.0;                                           /** time of the steps of the last run after the solver */
+    SOLVER_STATUS status = converged;                                   /** how the last run stopped */
+    double achieved_gradient_norm = 0.0;                                /** projected gradient norm of the solution of the last run, 
+                                                                            as compared with the convergence threshold, infinity 
+                                                                            if no gradient was computed. It is the equilibrium 
+                                                                            residual: each agent is stationary on its own inputs 
+                                                                            given the others when it is zero */
+    double constraint_violation = 0.0;                                  /** largest constraint of the solution of the last run */
+    int iterations = 0;                                                 /** trust region iterations of the last run */
+    mutable SolverStats stats;                                          /** timings and counters of the phases of the last run, 
+                                                                            only with PLANNER_PROFILING */
+    int gradient_evaluations = 0;                                       /** gradients of all the agents computed in the last run */
+    int agent_gradient_evaluations = 0;                                 /** gradients of a single agent computed by the best response 
+                                                                            in the last run */
+    int subproblem_iterations = 0;                                      /** iterations of the subproblem solver in the last run, 
+                                                                            summed over the agents */
+    int cache_hits = 0;                                                 /** rollouts, lagrangians and gradients of the last run 
+                                                                            taken from the evaluation cache */
+    long lagrangian_epoch = 0;                                          /** changes with the lagrangian multipliers, rho and the 
+                                                                            collision blocks, the cached lagrangians and gradients 
+                                                                            are valid for one epoch */
+
+    int M_old = 0;                                                      /** number of traffic participants in the previous run */
+    int N_old = 0;                                                      /** integration nodes minus one in the previous run */
+    double dt_old = 0.0;                                                /** integration time step in the previous run */
+    std::vector<double> U_old;                                          /** solution in the previous run */
+    std::vector<int> id_old;                                            /** vehicle identifiers in the previous run */
+    std::vector<double> lagrangian_multipliers_old;                     /** lagrangian multipliers in the previous run */
+    std::vector<CollisionBlock> blocks_old;                             /** collision blocks in the previous run */
+    std::vector<int> block_start_old;                                   /** first collision block of each vehicle in the previous run */
+    std::vector<int> constraint_start_old;                              /** first constraint of each vehicle in the previous run */
+
+    mutable Workspace workspace;                                        /** preallocated buffers, scratch memory only */
+};
+
+/** Outcome of one scene of solve_batch, the predictions are written in the scene */
+struct SceneResult {
+    SOLVER_STATUS status = converged;                                   /** how the solve stopped */
+    int iterations = 0;                                                 /** trust region iterations */
+    double achieved_gradient_norm = 0.0;                                /** projected gradient norm of the solution */
+    double constraint_violation = 0.0;                                  /** largest constraint of the solution */
+    int gradient_evaluations = 0;                                       /** gradients of all the agents computed */
+    int subproblem_iterations = 0;                                      /** iterations of the subproblem solver, summed over the agents */
+    int cache_hits = 0;                                                 /** evaluations taken from the evaluation cache */
+    double solve_time = 0.0;                                            /** wall time of the solve in seconds */
+    SolverStats stats;                                                  /** timings and counters of the phases, only with 
+                                                                            PLANNER_PROFILING */
+};
+
+/** Planner of the dynamic game with N + 1 integration nodes. The per-agent vectors and Hessian matrices have a size 
+ * known at compile time, the planner is instantiated in dynamic_game_planner.cpp for N = 5, 10, 20 and 40 */
+template <int N_ = 20>
 class DynamicGamePlanner {
 
 private:
@@ -22,20 +195,26 @@ private:
     const double pi = 3.1415;
     const double v_max = 10.0;
 
-    constexpr static const int N = 20;                                  /** number of integration nodes */
+    constexpr static const int N = N_;                                  /** number of integration nodes */
     constexpr static const int nX = 6;                                  /** <X, Y, V, PSI, S, L> */
     constexpr static const int nU = 2;                                  /** <d, F> */
+    constexpr static const int nR = 5;                                  /** reference point <X, Y, V, cos(PSI), sin(PSI)> */
+    constexpr static const int nB = 5;                                  /** nodes in each window of the broad phase */
+    constexpr static const int nW = (N + nB) / nB;                      /** windows of the broad phase */
+    constexpr static const int nF = N + 1;                              /** lane constraints of each vehicle, the collision 
+                                                                            blocks follow. The input bounds are not constraints, 
+                                                                            the steps of the trust region stay within them */
 
 public:
-    static const int nx = nX * (N + 1);                                 /** size of the state trajectory X_i for each vehicle */
-    static const int nu = nU * (N + 1);                                 /** size of the input trajectory U_i for each vehicle */
-    int M;                                                              /** number of agents */ 
-    int nC;                                                             /** total number of inequality constraints */
-    int nC_i;                                                           /** inequality constraints for one vehicle */
-    int nG;                                                             /** number of elements in the gradient G */
-    int nX_;                                                            /** number of elements in the state vector X */
-    int nU_;                                                            /** number of elements in the input vector U */
-    int M_old;                                                          /** number of traffic participants in the previous iteration*/
+    constexpr static const int nx = nX * (N + 1);                       /** size of the state trajectory X_i for each vehicle */
+    constexpr static const int nu = nU * (N + 1);                       /** size of the input trajectory U_i for each vehicle */
+    constexpr static const int lanes = 8;                               /** rollouts advanced together by integrate_vehicle_i_lanes */
+    constexpr static const int cache_entries = 3;                       /** inputs kept by the evaluation cache: current, 
+                                                                            candidate and next solution */
+
+    typedef Eigen::Matrix<double, nu, nu> HessianMatrix;                /** Hessian matrix of one agent */
+    typedef Eigen::Matrix<double, nu, 1> InputVector;                   /** input trajectory, gradient or step of one agent */
+    typedef LimitedMemoryHessian<nu> LimitedHessian;                    /** limited-memory Hessian of one agent */
     double dt = 0.3;                                                    /** integration time step */
     double d_up = 0.7;                                                  /** upper bound yaw rate */
     double d_low = -0.7;                                                /** lower bound yaw rate */
@@ -45,73 +224,297 @@ public:
     // Parameters:
     double qf = 1e-2;                                                   /** penalty for the final error in the lagrangian */
     double gamma = 1.3;                                                 /** increasing factor of the penalty weight */
-    double rho = 1e-3;                                                  /** penalty weight */ 
+    double rho = 1e-3;                                                  /** initial penalty weight of each run */ 
     double weight_target_speed = 1e0;                                      /** weight for the maximum speed in the lagrangian */
     double weight_center_lane = 1e-1;                                   /** weight for the center lane in the lagrangian */
     double weight_heading = 1e2;                                        /** weight for the heading in the lagrangian */
     double weight_input = 0.0;                                          /** weight for the input in the lagrangian */
+    double min_chunk_cost = 200.0;                                      /** minimum work of a parallel task, in integration steps */
+    int min_parallel_agents = 8;                                        /** agents from which the steps of the trust region are 
+                                                                            computed in parallel */
+    bool simd_rollout = true;                                           /** finite differences with the batched rollout kernel */
+    bool broad_phase = true;                                            /** collision constraints only for vehicles that can get close */
+    double collision_margin = 0.0;                                      /** distance added to r_safe by the collision avoidance 
+                                                                            constraints, a coarse level covers with it the motion 
+                                                                            between its nodes */
+    double broad_phase_margin = 10.0;                                   /** distance added to r_safe by the broad phase, it bounds 
+                                                                            the motion of the vehicles within one iteration */
+    bool evaluation_cache = true;                                       /** the trust region reuses the rollouts, lagrangians and 
+                                                                            gradients of the inputs already evaluated */
     
-    std::vector<double> U_old;                                          /** solution in the previous iteration*/
-    Eigen::MatrixXd ul;                                                 /** controls lower bound*/
-    Eigen::MatrixXd uu;                                                 /** controls upper bound*/
-    Eigen::MatrixXd time;                                               /** time vector */
-    Eigen::MatrixXd lagrangian_multipliers;                             /** lagrangian multipliers*/
+    bool warm_start = false;                                            /** starts from the shifted solution of the previous run */
+    bool decompose_interactions = true;                                 /** groups of vehicles that cannot get closer than r_safe 
+                                                                            within the horizon are solved as separate games */
     
     enum STATES {x, y, v, psi, s, l};
     enum INPUTS {d, F};
+    enum REFERENCE {x_ref, y_ref, v_ref, cos_ref, sin_ref};
+    enum GRADIENT_METHODS {finite_differences, adjoint};
+    enum SUBPROBLEM_METHODS {cauchy_point, dogleg, steihaug_cg};
+    enum HESSIAN_METHODS {dense_sr1, limited_sr1, limited_bfgs};
+    enum SOLVER_METHODS {trust_region, best_response_jacobi, best_response_gauss_seidel};
+
+    GRADIENT_METHODS gradient_method = finite_differences;              /** method used to compute the gradient of the lagrangian */
+    SUBPROBLEM_METHODS subproblem_method = cauchy_point;                /** method used to solve the quadratic subproblem of the 
+                                                                            trust region */
+    HESSIAN_METHODS hessian_method = dense_sr1;                         /** approximation of the Hessian of each agent */
+    int memory_length = 10;                                             /** pairs kept by the limited-memory Hessians, 
+                                                                            at most LimitedHessian::max_memory */
+    SOLVER_METHODS solver_method = trust_region;                        /** engine of the game: joint trust region on all the agents, 
+                                                                            or iterated best response with Jacobi or Gauss-Seidel 
+                                                                            sweeps */
+    int best_response_iterations = 3;                                   /** trust region iterations of each agent in a sweep of 
+                                                                            the best response */
+    int max_iterations = 20;                                            /** iterations of the trust region, or sweeps of the best 
+                                                                            response, in each run */
+    int refinement_iterations = 5;                                      /** iteration limit of the runs that start from the 
+                                                                            solution of the coarse level, an infeasible solution 
+                                                                            goes on up to max_iterations */
+    std::function<void(const TrafficParticipants&, SolverState&, 
+                       double, double)> coarse_level;                   /** multi-resolution: solve of a planner with fewer nodes 
+                                                                            over the horizon of this planner, its solution is 
+                                                                            the initial guess of each run instead of the warm 
+                                                                            start. Empty for a single level, see 
+                                                                            set_coarse_level() */
 
-    TrafficParticipants traffic;
+    std::shared_ptr<ThreadPool> thread_pool;                            /** worker threads used to compute the gradient */
+    std::shared_ptr<DiagnosticsSink> diagnostics 
+        = std::make_shared<NullDiagnostics>();                          /** receiver of the iterations, trajectories and violated 
+                                                                            constraints of each run, nothing by default */
 
     DynamicGamePlanner();  // Constructor
+    explicit DynamicGamePlanner(std::shared_ptr<ThreadPool> thread_pool_);  // Constructor with a shared thread pool
     ~DynamicGamePlanner(); // Destructor
 
-    void run( TrafficParticipants& traffic_state );                                 /** Main method to execute the planner */
-    void setup();                                                                   /** Setup function */
-    void initial_guess(double* X, double* U);                                       /** Set the initial guess */
-    void trust_region_solver(double* U_);                                           /** solver of the dynamic game based on trust region */
-    void integrate(double* X, const double* U);                                     /** Integration function */
+    void run( TrafficParticipants& traffic_state ) const;                           /** Main method to execute the planner, the predictions 
+                                                                                        are written in traffic_state */
+    void run( TrafficParticipants& traffic_state, SolverState& state, 
+              double elapsed_time = 0.0, double time_budget = 0.0 ) const;          /** Main method with a solver state kept by the caller, 
+                                                                                        elapsed_time is the time since the previous run. 
+                                                                                        With a time_budget in seconds the solver stops at 
+                                                                                        the deadline with the best iterate found */
+    void solve( const TrafficParticipants& traffic_state, SolverState& state, 
+                double elapsed_time = 0.0, double time_budget = 0.0 ) const;        /** same as run() without writing the predictions, 
+                                                                                        the solution is left in state.workspace */
+    void solve_batch( TrafficParticipants* scenes, int num_scenes, 
+                      std::vector<SceneResult>& results, 
+                      double time_budget = 0.0 ) const;                             /** solves independent scenes on the thread pool, 
+                                                                                        the predictions are written in each scene. 
+                                                                                        time_budget applies to each scene */
+    template <int N_coarse>
+    void set_coarse_level(std::shared_ptr<DynamicGamePlanner<N_coarse>> coarse);   /** solves each run on coarse first, its time step 
+                                                                                        is set to cover the horizon of this planner and 
+                                                                                        it works on the thread pool of this planner. 
+                                                                                        Call it again after changing dt or 
+                                                                                        collision_margin. coarse can have its own 
+                                                                                        coarse level */
+    template <int N_coarse>
+    std::shared_ptr<DynamicGamePlanner<N_coarse>> set_coarse_level();              /** same with a new coarse planner, returned to set 
+                                                                                        its parameters */
+    void setup(SolverState& state) const;                                           /** Setup function */
+    void allocate_workspace(const SolverState& state) const;                        /** sizes the workspace if the number of agents 
+                                                                                        or of threads changed */
+    void initial_guess(const SolverState& state, double* X, double* U) const;       /** Set the initial guess */
+    void warm_start_guess(SolverState& state, double* X, double* U, 
+                          double elapsed_time) const;                               /** Set the initial guess and the lagrangian multipliers 
+                                                                                        from the previous solution shifted by elapsed_time */
+    void coarse_guess(SolverState& state, const SolverState& coarse, const int* members, 
+                      double* X, double* U) const;                                  /** Set the initial guess and the lagrangian multipliers 
+                                                                                        from the solution of the coarse level, vehicle i 
+                                                                                        is members[i] of the coarse level, or i if null */
+    void interpolate_guess(SolverState& state, const SolverState& previous, double* X, 
+                           double* U, double elapsed_time) const;                   /** Set the initial guess and the lagrangian multipliers 
+                                                                                        of the matched vehicles from the solution saved in 
+                                                                                        previous, on its own time grid */
+    void save_warm_start(SolverState& state, const double* U) const;                /** saves the solution for the next warm start */
+    int collision_row(const std::vector<CollisionBlock>& blocks, int begin, int end, 
+                      int k, int j) const;                                          /** row of the collision constraint with vehicle k at 
+                                                                                        node j among the blocks begin ... end - 1 of a 
+                                                                                        vehicle, -1 if not stored */
+    void solve_game(SolverState& state, double* U_) const;                          /** solver of the dynamic game selected by solver_method */
+    void trust_region_solver(SolverState& state, double* U_) const;                 /** solver of the dynamic game based on trust region */
+    void best_response_solver(SolverState& state, double* U_) const;                /** solver of the dynamic game based on iterated best 
+                                                                                        response */
+    int interaction_components(SolverState& state) const;                           /** groups the vehicles that can interact within the 
+                                                                                        horizon, returns the number of groups */
+    void solve_components(SolverState& state, double* U_, 
+                          double elapsed_time) const;                               /** solves each group of vehicles as a separate game 
+                                                                                        in parallel and merges the solutions */
+    double remaining_time(const SolverState& state) const;                          /** time left in seconds before the deadline of the run, 
+                                                                                        infinity without time budget */
+    void integrate(const SolverState& state, double* X, const double* U) const;     /** Integration function */
+    void integrate_vehicle_i(const SolverState& state, double* X, const double* U, 
+                             int i, int j_start) const;                             /** integrates vehicle i from node j_start onward, 
+                                                                                        starting from the state stored in X at node j_start - 1 */
+    void integrate_vehicle_i_lanes(const SolverState& state, double* X_lanes, const double* X, 
+                             const double* U, const int* perturbed, int i, int j_start) const;  /** integrates lanes copies of vehicle i from node j_start 
+                                                                                        onward, the copy w with the input perturbed[w] increased 
+                                                                                        by eps. X_lanes is stored as [node][state][lane] */
     void dynamic_step(double* d_state, const double* state, const double* ref_state, 
-                    const double* control);                                         /** Dynamic step function */
-    void hessian_SR1_update( Eigen::MatrixXd & H_, const Eigen::MatrixXd & s_,            
-                     const Eigen::MatrixXd & y_, const double r_ );                /** SR1 Hessian matrix update*/
-    void increasing_schedule();                                                    /** function to increase rho = rho * gamma */
-    void save_lagrangian_multipliers(double* lagrangian_multipliers_);             /** function to save the lagrangian multipliers */
-    void compute_lagrangian_multipliers(double* lagrangian_multipliers_, 
-                                        const double* constraints_);               /** computation of the lagrangian multipliers */
+                    const double* control) const;                                   /** Dynamic step function */
+    void hessian_SR1_update( Eigen::Ref<HessianMatrix> H_, const Eigen::Ref<const InputVector> & s_,            
+                     const Eigen::Ref<const InputVector> & y_, const double r_ ) const;    /** SR1 Hessian matrix update*/
+    void increasing_schedule(SolverState& state) const;                            /** function to increase rho = rho * gamma */
+    void save_lagrangian_multipliers(SolverState& state, 
+                                     double* lagrangian_multipliers_) const;       /** function to save the lagrangian multipliers */
+    void compute_lagrangian_multipliers(const SolverState& state, double* lagrangian_multipliers_, 
+                                        const double* constraints_) const;         /** computation of the lagrangian multipliers */
     
-    void compute_constraints(double* constraints, const double* X_, 
-                            const double* U_);                                     /** computation of the inequality constraints */
-    void compute_constraints_vehicle_i(double* C_i, 
-                            const double* X_, const double* U_, int i);            /** computation of the inequality constraints 
-                                                                                        for vehicle i */
-    void compute_squared_distances_vector(double* squared_distances_, const double* X_, 
-                            int ego, int j);                                       /** computes a vector of the squared distance 
-                                                                                        between the trajectory of vehicle i and j*/
-    void compute_squared_lateral_distance_vector(double* squared_distances_, 
-                            const double* X_, int i);                               /** computes a vector of the squared lateral distance 
+    void compute_constraints(const SolverState& state, double* constraints, 
+                            const double* X_) const;                               /** computation of the inequality constraints */
+    void compute_constraints_vehicle_i(const SolverState& state, double* C_i, const double* X_, 
+                            const double* pair_distances, int i) const;             /** computation of the inequality constraints 
+                                                                                        for vehicle i, the collision ones from the 
+                                                                                        distance tensor */
+    void update_constraints_vehicle_i(const SolverState& state, double* C_i, 
+                            const double* X_, int i, int j_start) const;           /** recomputes the constraints of vehicle i at the 
+                                                                                        nodes from j_start onward */
+    void compute_pair_distances(const SolverState& state, double* pair_distances, 
+                            const double* X_) const;                                /** distance tensor: squared distance of each near 
+                                                                                        pair, computed once for both vehicles */
+    void update_broad_phase(SolverState& state, const double* X_, 
+                            bool merge = false) const;                              /** finds the pairs of vehicles close enough to collide 
+                                                                                        in each window of nodes */
+    void update_constraint_blocks(SolverState& state) const;                       /** stores the collision constraints of the near pairs, 
+                                                                                        the multipliers of the blocks kept are preserved */
+    void compute_squared_lateral_distance_vector(const SolverState& state, double* squared_distances_, 
+                            const double* X_, int i, int j_start = 0) const;        /** computes a vector of the squared lateral distance 
                                                                                         between the i-th trajectory and the allowed center 
-                                                                                        lines at each time step*/
-    double compute_cost_vehicle_i(const double* X_, const double* U_, int i);         /** compute the cost for vehicle i */
-    void compute_lagrangian(double* lagrangian, 
-                            const double* X_, const double* U_);                    /** computes of the augmented lagrangian vector 
+                                                                                        lines at each time step from j_start onward */
+    double compute_cost_vehicle_i(const double* X_, const double* U_, int i) const;   /** compute the cost for vehicle i */
+    void compute_lagrangian(const SolverState& state, double* lagrangian, 
+                            const double* X_, const double* U_) const;              /** computes of the augmented lagrangian vector 
                                                                                     L = <L_1, ..., L_M> 
                                                                                     L_i = cost_i + lagrangian_multipliers * constraints */
-    double compute_lagrangian_vehicle_i(double J_i, const double* C_i, int i);      /** computation of the augmented lagrangian for vehicle i: 
+    double compute_lagrangian_vehicle_i(const SolverState& state, double J_i, 
+                            const double* C_i, int i) const;                        /** computation of the augmented lagrangian for vehicle i: 
                                                                                 lagrangian_i = cost_i + lagrangian_multipliers_i * constraints_i */
-    void compute_gradient(double* gradient, const double* U_);                      /** computes the gradient of lagrangian_i with respect to 
+    void compute_gradient(const SolverState& state, double* gradient, 
+                            const double* U_) const;                                /** computes the gradient of lagrangian_i with respect to 
                                                                                     U_i for each i */
-    void quadratic_problem_solver(Eigen::MatrixXd & s_, 
-                                const Eigen::MatrixXd & G_, 
-                                const Eigen::MatrixXd & H_, double Delta);          /** it solves the quadratic problem 
+    void compute_gradient(const SolverState& state, double* gradient, const double* X_, const double* U_, 
+                            const double* lagrangian) const;                        /** same with the state trajectory X_ and the lagrangian 
+                                                                                        at U_ already computed */
+    void compute_gradient_finite_differences(const SolverState& state, double* gradient, const double* X_, 
+                            const double* U_, const double* lagrangian) const;      /** gradient computed with finite differences (reference) */
+    void split_gradient_work(const SolverState& state, std::vector<int>& bounds) const;  /** splits the nU_ finite-difference perturbations in chunks 
+                                                                                        of similar cost for the thread pool */
+    void compute_gradient_adjoint(const SolverState& state, double* gradient, const double* X_, 
+                            const double* U_) const;                                /** gradient computed with the adjoint (reverse-mode) method */
+    void reset_evaluation_cache(const SolverState& state) const;                    /** empties the evaluation cache */
+    int cache_entry(SolverState& state, const double* U_) const;                    /** entry of the evaluation cache with the inputs U_ and 
+                                                                                        their state trajectory, the least recently used entry 
+                                                                                        is replaced if U_ is new */
+    void cached_integrate(SolverState& state, double* X_, const double* U_) const;  /** integrate() through the evaluation cache */
+    void cached_lagrangian(SolverState& state, double* lagrangian, 
+                           const double* U_) const;                                 /** compute_lagrangian() through the evaluation cache */
+    void cached_gradient(SolverState& state, double* gradient, 
+                         const double* U_) const;                                   /** compute_gradient() through the evaluation cache */
+    void compute_gradient_vehicle_i(const SolverState& state, double* gradient_i, double* X_, double* U_, 
+                            const double* C_i, double lagrangian_i, int i) const;   /** gradient of lagrangian_i with respect to U_i alone, 
+                                                                                        from the trajectory, constraints and lagrangian of 
+                                                                                        vehicle i at U_ */
+    void compute_gradient_vehicle_i_finite_differences(const SolverState& state, double* gradient_i, 
+                            double* X_, double* U_, const double* C_i, 
+                            double lagrangian_i, int i) const;                      /** same with finite differences, X_ and U_ are 
+                                                                                        perturbed and restored */
+    void compute_gradient_vehicle_i_adjoint(const SolverState& state, double* gradient_i, const double* X_, 
+                            const double* U_, const double* C_i, int i) const;      /** backpropagates lagrangian_i through the rollout of 
+                                                                                        vehicle i to get the gradient with respect to U_i */
+    void compute_squared_lateral_distance_gradient(const SolverState& state, double* d_dist2_x, double* d_dist2_y, 
+                            double* d_dist2_s, const double* X_, int i) const;      /** derivatives of the squared lateral distance vector 
+                                                                                        with respect to x, y and s of the i-th trajectory */
+    int quadratic_problem_solver(Eigen::Ref<InputVector> s_, 
+                                const Eigen::Ref<const InputVector> & G_, 
+                                const Eigen::Ref<const HessianMatrix> & H_, double Delta, 
+                                const Eigen::Ref<const InputVector> & s_low, 
+                                const Eigen::Ref<const InputVector> & s_up) const;  /** it solves the quadratic problem 
                                                                                         (GT * s + 0.5 * sT * H * s) with solution included in the 
-                                                                                        trust region ||s|| < Delta */
-    void constraints_diagnostic(const double* constraints, bool print);             /** shows violated constraints */
-    void print_trajectories(const double* X, const double* U);                      /** prints trajectories */
-    TrafficParticipants set_prediction(const double* X_, const double* U_);         /** sets the prediction to the traffic structure */
+                                                                                        trust region ||s|| < Delta and in the box s_low <= s <= s_up, 
+                                                                                        returns the iterations of the subproblem_method */
+    int quadratic_problem_solver(Eigen::Ref<InputVector> s_, 
+                                const Eigen::Ref<const InputVector> & G_, 
+                                const LimitedHessian & H_, double Delta, 
+                                const Eigen::Ref<const InputVector> & s_low, 
+                                const Eigen::Ref<const InputVector> & s_up) const;  /** same with a limited-memory Hessian */
+    void compute_violations(const SolverState& state, const double* constraints, 
+                            std::vector<ConstraintViolation>& violations) const;    /** lists the violated constraints */
+    void set_prediction(const SolverState& state, const double* X_, const double* U_, 
+                        TrafficParticipants& traffic_state) const;                  /** sets the prediction to the traffic structure */
     double compute_heading(const tk::spline & spline_x, 
-                           const tk::spline & spline_y, double s);                  /** computes the heading on the spline x(s) and y(s) at parameter s */
-    double gradient_norm(const double* gradient);                                               /** computes the norm of the gradient */
-    void correctionU(double* U_);                                                    /** corrects U if outside the boundaries */
+                           const tk::spline & spline_y, double s) const;            /** computes the heading on the spline x(s) and y(s) at parameter s */
+    double gradient_norm(const SolverState& state, const double* gradient, 
+                         const double* U_) const;                                   /** computes the norm of the gradient projected 
+                                                                                        on the input bounds */
+    void correctionU(const SolverState& state, double* U_) const;                   /** sets the input of the last node */
+
+private:
+    // Engines of quadratic_problem_solver, for the dense and the limited-memory Hessians:
+    template <class Hessian>
+    int quadratic_problem_cauchy_point(Eigen::Ref<InputVector> s_, 
+                                const Eigen::Ref<const InputVector> & G_, 
+                                const Hessian & H_, double Delta, 
+                                const Eigen::Ref<const InputVector> & s_low, 
+                                const Eigen::Ref<const InputVector> & s_up) const;  /** generalized Cauchy point of the quadratic problem */
+    template <class Hessian>
+    int quadratic_problem_dogleg(Eigen::Ref<InputVector> s_, 
+                                const Eigen::Ref<const InputVector> & G_, 
+                                const Hessian & H_, double Delta, 
+                                const Eigen::Ref<const InputVector> & s_low, 
+                                const Eigen::Ref<const InputVector> & s_up) const;  /** dogleg step of the quadratic problem */
+    template <class Hessian>
+    int quadratic_problem_steihaug_cg(Eigen::Ref<InputVector> s_, 
+                                const Eigen::Ref<const InputVector> & G_, 
+                                const Hessian & H_, double Delta, 
+                                const Eigen::Ref<const InputVector> & s_low, 
+                                const Eigen::Ref<const InputVector> & s_up) const;  /** truncated conjugate gradient (Steihaug-Toint) step 
+                                                                                        of the quadratic problem */
+    double max_step(const Eigen::Ref<const InputVector> & s_, 
+                    const Eigen::Ref<const InputVector> & p, double Delta, 
+                    const Eigen::Ref<const InputVector> & s_low, 
+                    const Eigen::Ref<const InputVector> & s_up) const;              /** largest t such that s_ + t * p is in the 
+                                                                                        trust region and in the box */
+    template <class Hessian>
+    int best_response_vehicle_i(const SolverState& state, double* X_, double* U_, double* gradient_i, 
+                                bool fresh, Hessian & H_, double& delta_i, int i) const;   /** trust region iterations of vehicle i 
+                                                                                        on its own inputs, the others are frozen */
+    void hessian_update(Eigen::Ref<HessianMatrix> H_, const InputVector & s_, 
+                        const InputVector & y_, double r_) const;                   /** SR1 update of a dense Hessian */
+    void hessian_update(LimitedHessian & H_, const InputVector & s_, 
+                        const InputVector & y_, double r_) const;                   /** update of a limited-memory Hessian */
+    bool newton_point(Eigen::Ref<InputVector> p_n, const Eigen::Ref<const InputVector> & G_free, 
+                      const Eigen::Ref<const HessianMatrix> & H_, 
+                      const Eigen::Ref<const InputVector> & free_) const;          /** solution of H * p_n = - G_free on the free inputs 
+                                                                                        (free_ = 1), false if H is not positive definite there */
+    bool newton_point(Eigen::Ref<InputVector> p_n, const Eigen::Ref<const InputVector> & G_free, 
+                      const LimitedHessian & H_, 
+                      const Eigen::Ref<const InputVector> & free_) const;          /** same with a limited-memory Hessian */
 };
 
+/** the coarse planner is instantiated for another N, the hook keeps it alive and hides its type. Between two nodes of 
+ * the coarse level a vehicle moves up to v_max * (coarse->dt - dt) more than on this level: half of it is added to the 
+ * safety distance of the coarse level, so that the vehicles do not cross each other between its nodes. The time step 
+ * and the margin are set here only, run() does not change the coarse planner: after a change of dt or of 
+ * collision_margin set_coarse_level must be called again */
+template <int N_>
+template <int N_coarse>
+void DynamicGamePlanner<N_>::set_coarse_level(std::shared_ptr<DynamicGamePlanner<N_coarse>> coarse)
+{
+    coarse->thread_pool = thread_pool;
+    coarse->dt = dt * N / N_coarse;
+    coarse->collision_margin = collision_margin + 0.5 * v_max * (coarse->dt - dt);
+    coarse_level = [coarse](const TrafficParticipants& traffic_state, SolverState& state, double elapsed_time, double time_budget) {
+        coarse->solve(traffic_state, state, elapsed_time, time_budget);
+    };
+}
+
+template <int N_>
+template <int N_coarse>
+std::shared_ptr<DynamicGamePlanner<N_coarse>> DynamicGamePlanner<N_>::set_coarse_level()
+{
+    std::shared_ptr<DynamicGamePlanner<N_coarse>> coarse = std::make_shared<DynamicGamePlanner<N_coarse>>(thread_pool);
+    set_coarse_level(coarse);
+    return coarse;
+}
+
 #endif // DYNAMIC_GAME_PLANNER_H
@@ -0,0 +1,185 @@
+#ifndef LIMITED_MEMORY_HESSIAN_H
+#define LIMITED_MEMORY_HESSIAN_H
+
+#include <cstring>
+#include <cmath>
+#include <eigen3/Eigen/Dense>
+
+/** Limited-memory quasi-Newton approximation of a Hessian of size n in compact form (Byrd, Nocedal and Schnabel, 1994):
+ *      B = gamma * I + W * K * W^T
+ * built from the last m pairs s = u_k+1 - u_k, y = g_k+1 - g_k, the columns of S and Y (oldest first). With D the
+ * diagonal and L the strictly lower triangle of S^T * Y:
+ *      SR1:  W = Y - gamma * S,    K = (D + L + L^T - gamma * S^T * S)^-1,    gamma = 1
+ *      BFGS: W = [gamma * S, Y],   K = - [gamma * S^T * S, L; L^T, -D]^-1,   gamma = y^T * y / s^T * y of the last pair
+ * With all the pairs in memory the SR1 one is the dense SR1 update of the identity. Products with B cost O(n * m),
+ * an update O(n * m + m^3). The class is a view on size(m) doubles of external memory, like Eigen::Map, so that
+ * the Hessians of all the agents live in one flat buffer.
+ * Layout: <gamma, pairs, S (n x m), Y (n x m), W (n x 2m), S^T * S (m x m), S^T * Y (m x m), K (2m x 2m)> */
+template <int n>
+class LimitedMemoryHessian {
+public:
+    constexpr static const int max_memory = 20;                         /** largest number of pairs */
+
+    typedef Eigen::Matrix<double, n, 1> Vector;
+    typedef Eigen::Matrix<double, Eigen::Dynamic, 1, 0, 2 * max_memory, 1> SmallVector;
+    typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, 0, 2 * max_memory, 2 * max_memory> SmallMatrix;
+    enum UPDATES {SR1, BFGS};
+
+    LimitedMemoryHessian(double* data_, int m_, UPDATES update_) : data(data_), m(m_), update_type(update_) {}
+
+    static int size(int m_) { return 2 + 4 * n * m_ + 2 * m_ * m_ + 4 * m_ * m_; }    /** doubles of storage for m_ pairs */
+    int pairs() const { return (int) data[1]; }                         /** pairs in memory */
+    double gamma() const { return data[0]; }                            /** scaling of the identity */
+
+    void reset();                                                       /** B = I without pairs */
+    bool update(const Vector& s_, const Vector& y_, double r_);        /** adds the pair (s_, y_), the oldest one is dropped
+                                                                            if the memory is full. The pair is skipped if
+                                                                            the update is not defined, with the threshold
+                                                                            r_ (returns false) */
+    Vector operator*(const Eigen::Ref<const Vector>& v) const;           /** B * v */
+
+private:
+    double* data;
+    int m;
+    UPDATES update_type;
+
+    double* S() const { return data + 2; }
+    double* Y() const { return data + 2 + n * m; }
+    double* W() const { return data + 2 + 2 * n * m; }
+    double* StS() const { return data + 2 + 4 * n * m; }
+    double* StY() const { return data + 2 + 4 * n * m + m * m; }
+    double* K() const { return data + 2 + 4 * n * m + 2 * m * m; }
+    int columns() const { return (update_type == SR1) ? pairs() : 2 * pairs(); }   /** columns of W */
+    bool factorize();                                                   /** computes W and K from the pairs */
+};
+
+template <int n>
+void LimitedMemoryHessian<n>::reset()
+{
+    data[0] = 1.0;
+    data[1] = 0.0;
+}
+
+template <int n>
+bool LimitedMemoryHessian<n>::update(const Vector& s_, const Vector& y_, double r_)
+{
+    int k = pairs();
+    Eigen::Map<Eigen::Matrix<double, n, Eigen::Dynamic>> S_(S(), n, m);
+    Eigen::Map<Eigen::Matrix<double, n, Eigen::Dynamic>> Y_(Y(), n, m);
+    Eigen::Map<Eigen::MatrixXd> StS_(StS(), m, m);
+    Eigen::Map<Eigen::MatrixXd> StY_(StY(), m, m);
+
+    // Same safeguards as the dense updates:
+    if (update_type == SR1){
+        const Vector r = y_ - (*this) * s_;
+        if (!(std::abs(s_.dot(r)) > r_ * s_.squaredNorm() * r.squaredNorm())){
+            return false;
+        }
+    }else{
+        if (!(s_.dot(y_) > r_ * s_.norm() * y_.norm())){
+            return false;
+        }
+    }
+
+    // Drop the oldest pair:
+    if (k == m){
+        std::memmove(S(), S() + n, sizeof(double) * n * (m - 1));
+        std::memmove(Y(), Y() + n, sizeof(double) * n * (m - 1));
+        for (int j = 0; j < m - 1; j++){
+            for (int i = 0; i < m - 1; i++){
+                StS_(i, j) = StS_(i + 1, j + 1);
+                StY_(i, j) = StY_(i + 1, j + 1);
+            }
+        }
+        k--;
+    }
+
+    // New pair, and its row and column of S^T * S and S^T * Y:
+    S_.col(k) = s_;
+    Y_.col(k) = y_;
+    for (int j = 0; j <= k; j++){
+        StS_(k, j) = s_.dot(S_.col(j));
+        StS_(j, k) = StS_(k, j);
+        StY_(k, j) = s_.dot(Y_.col(j));
+        StY_(j, k) = S_.col(j).dot(y_);
+    }
+    data[1] = k + 1;
+    if (update_type == BFGS){
+        data[0] = y_.squaredNorm() / s_.dot(y_);
+    }
+
+    // If the middle matrix is singular (pairs dropped from the memory), only the last pair is kept:
+    if (!factorize()){
+        S_.col(0) = s_;
+        Y_.col(0) = y_;
+        StS_(0, 0) = s_.squaredNorm();
+        StY_(0, 0) = s_.dot(y_);
+        data[1] = 1;
+        factorize();
+    }
+    return true;
+}
+
+template <int n>
+bool LimitedMemoryHessian<n>::factorize()
+{
+    const int k = pairs();
+    const int c = columns();
+    const double g = gamma();
+    Eigen::Map<const Eigen::Matrix<double, n, Eigen::Dynamic>> S_(S(), n, k);
+    Eigen::Map<const Eigen::Matrix<double, n, Eigen::Dynamic>> Y_(Y(), n, k);
+    Eigen::Map<Eigen::Matrix<double, n, Eigen::Dynamic>> W_(W(), n, c);
+    Eigen::Map<const Eigen::MatrixXd> StS_(StS(), m, m);
+    Eigen::Map<const Eigen::MatrixXd> StY_(StY(), m, m);
+    Eigen::Map<Eigen::MatrixXd> K_(K(), c, c);
+    SmallMatrix middle(c, c);
+
+    if (update_type == SR1){
+        W_ = Y_ - g * S_;
+        for (int j = 0; j < k; j++){
+            for (int i = 0; i < k; i++){
+                middle(i, j) = ((i >= j) ? StY_(i, j) : StY_(j, i)) - g * StS_(i, j);
+            }
+        }
+    }else{
+        W_.leftCols(k) = g * S_;
+        W_.rightCols(k) = Y_;
+        for (int j = 0; j < k; j++){
+            for (int i = 0; i < k; i++){
+                middle(i, j) = g * StS_(i, j);
+                middle(k + i, k + j) = (i == j) ? - StY_(i, i) : 0.0;
+                middle(i, k + j) = (i > j) ? StY_(i, j) : 0.0;
+                middle(k + j, i) = middle(i, k + j);
+            }
+        }
+    }
+
+    Eigen::FullPivLU<SmallMatrix> lu(middle);
+    if (!lu.isInvertible()){
+        return false;
+    }
+    if (update_type == SR1){
+        K_ = lu.inverse();
+    }else{
+        K_ = - lu.inverse();
+    }
+    return true;
+}
+
+template <int n>
+typename LimitedMemoryHessian<n>::Vector LimitedMemoryHessian<n>::operator*(const Eigen::Ref<const Vector>& v) const
+{
+    const int c = columns();
+    Vector out = gamma() * v;
+    if (c == 0){
+        return out;
+    }
+    Eigen::Map<const Eigen::Matrix<double, n, Eigen::Dynamic>> W_(W(), n, c);
+    Eigen::Map<const Eigen::MatrixXd> K_(K(), c, c);
+    SmallVector a = W_.transpose() * v;
+    SmallVector b = K_ * a;
+    out.noalias() += W_ * b;
+    return out;
+}
+
+#endif // LIMITED_MEMORY_HESSIAN_H
@@ -0,0 +1,101 @@
+#ifndef SOLVER_STATS_H
+#define SOLVER_STATS_H
+
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+/** Timings and counters of the phases of a run. They are collected only if the planner is compiled with
+ * PLANNER_PROFILING (cmake -DPLANNER_PROFILING=ON), otherwise the instrumentation macros are empty and the stats
+ * stay zero. The per-agent phases run on the thread pool, each agent accumulates in its own slots */
+struct SolverStats {
+    enum PHASES {integrate, compute_gradient, compute_lagrangian, compute_constraints, quadratic_problem_solver,
+                 hessian_update, phases};
+
+    double time[phases] = {};                                           /** seconds spent in each phase, summed over the
+                                                                            agents for the per-agent phases. The phases are 
+                                                                            timed inclusively and can nest: compute_constraints 
+                                                                            also runs inside compute_gradient, so the times of 
+                                                                            the phases do not add up to the time of the run */
+    long calls[phases] = {};                                            /** calls of each phase */
+    long rollouts = 0;                                                  /** trajectories of one vehicle integrated, from the
+                                                                            first node or from a perturbed node */
+    std::vector<int> accepted_steps;                                    /** steps of the trust region accepted by each agent */
+    std::vector<int> rejected_steps;                                    /** steps of the trust region rejected by each agent */
+    double rho = 0.0;                                                   /** penalty weight at the end of the solve */
+
+    std::vector<double> agent_time;                                     /** time of the per-agent phases, phases per agent */
+    std::vector<long> agent_calls;                                      /** calls of the per-agent phases, phases per agent */
+
+    /** clears the stats for a run with M agents */
+    void reset(int M)
+    {
+        for (int p = 0; p < phases; p++){
+            time[p] = 0.0;
+            calls[p] = 0;
+        }
+        rollouts = 0;
+        accepted_steps.assign(M, 0);
+        rejected_steps.assign(M, 0);
+        rho = 0.0;
+        agent_time.assign(phases * M, 0.0);
+        agent_calls.assign(phases * M, 0);
+    }
+
+    /** adds the stats of a sub-game, its agent a is the agent agents[a] of this game */
+    void merge(const SolverStats& other, const int* agents)
+    {
+        for (int p = 0; p < phases; p++){
+            time[p] += other.time[p];
+            calls[p] += other.calls[p];
+        }
+        rollouts += other.rollouts;
+        rho = std::max(rho, other.rho);
+        for (size_t a = 0; a < other.accepted_steps.size(); a++){
+            accepted_steps[agents[a]] = other.accepted_steps[a];
+            rejected_steps[agents[a]] = other.rejected_steps[a];
+            for (int p = 0; p < phases; p++){
+                agent_time[phases * agents[a] + p] = other.agent_time[phases * a + p];
+                agent_calls[phases * agents[a] + p] = other.agent_calls[phases * a + p];
+            }
+        }
+    }
+
+    /** adds the per-agent phases to the totals */
+    void collect()
+    {
+        const int M = accepted_steps.size();
+        for (int i = 0; i < M; i++){
+            for (int p = 0; p < phases; p++){
+                time[p] += agent_time[phases * i + p];
+                calls[p] += agent_calls[phases * i + p];
+            }
+        }
+    }
+};
+
+/** adds the time from its construction to its destruction to a phase */
+class ScopedPhase {
+public:
+    ScopedPhase(double& time_, long& calls_) : time(time_), start(std::chrono::steady_clock::now()) { calls_++; }
+    ~ScopedPhase() { time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); }
+
+private:
+    double& time;
+    std::chrono::steady_clock::time_point start;
+};
+
+#ifdef PLANNER_PROFILING
+#define PROFILE_PHASE(stats, phase) \
+    ScopedPhase profile_phase_((stats).time[SolverStats::phase], (stats).calls[SolverStats::phase])
+#define PROFILE_AGENT_PHASE(stats, phase, i) \
+    ScopedPhase profile_phase_((stats).agent_time[SolverStats::phases * (i) + SolverStats::phase], \
+                               (stats).agent_calls[SolverStats::phases * (i) + SolverStats::phase])
+#define PROFILE(statement) statement
+#else
+#define PROFILE_PHASE(stats, phase)
+#define PROFILE_AGENT_PHASE(stats, phase, i)
+#define PROFILE(statement)
+#endif
+
+#endif // SOLVER_STATS_H
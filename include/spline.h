@@ -82,6 +82,7 @@ protected:
     bool m_made_monotonic;
     void set_coeffs_from_b();               // calculate c_i, d_i from b_i
     size_t find_closest(double x) const;    // closest idx so that m_x[idx]<=x
+    size_t find_closest(double x, size_t hint) const;   // same, searching forward from hint
 
 public:
     // default constructor: set boundary condition to be zero curvature
@@ -132,6 +133,16 @@ public:
     double operator() (double x) const;
     double deriv(int order, double x) const;
 
+    // evaluates the spline and its first two derivatives at point x with a
+    // single search of the segment, which starts from cursor and walks
+    // forward: constant time if consecutive queries are increasing and close
+    // cursor is updated, any of the outputs can be NULL
+    void eval_cursor(double x, size_t& cursor, double* y,
+                     double* dy=NULL, double* ddy=NULL) const;
+    // same at the n points x[0] <= x[1] <= ... <= x[n-1]
+    void eval_sorted(const double* x, int n, double* y,
+                     double* dy=NULL, double* ddy=NULL) const;
+
     // returns the input data points
     std::vector<double> get_x() const { return m_x; }
     std::vector<double> get_y() const { return m_y; }
@@ -456,6 +467,63 @@ double spline::operator() (double x) const
     return interpol;
 }
 
+// return the closest idx so that m_x[idx] <= x, walking forward from hint
+// for a few segments before falling back to a binary search
+size_t spline::find_closest(double x, size_t hint) const
+{
+    const size_t max_steps=4;
+    size_t n=m_x.size();
+    if(hint>=n || x<m_x[hint]) {
+        return find_closest(x);
+    }
+    for(size_t step=0; step<max_steps; step++) {
+        if(hint+1>=n || x<m_x[hint+1]) {
+            return hint;
+        }
+        hint++;
+    }
+    std::vector<double>::const_iterator it;
+    it=std::upper_bound(m_x.begin()+hint,m_x.end(),x);  // *it > x
+    return size_t(it-m_x.begin())-1;
+}
+
+void spline::eval_cursor(double x, size_t& cursor, double* y,
+                         double* dy, double* ddy) const
+{
+    size_t n=m_x.size();
+    size_t idx=find_closest(x, cursor);
+    cursor=idx;
+
+    // same expressions as operator() and deriv()
+    double h=x-m_x[idx];
+    if(x<m_x[0]) {
+        // extrapolation to the left
+        if(y)   *y=(m_c0*h + m_b[0])*h + m_y[0];
+        if(dy)  *dy=2.0*m_c0*h + m_b[0];
+        if(ddy) *ddy=2.0*m_c0;
+    } else if(x>m_x[n-1]) {
+        // extrapolation to the right
+        if(y)   *y=(m_c[n-1]*h + m_b[n-1])*h + m_y[n-1];
+        if(dy)  *dy=2.0*m_c[n-1]*h + m_b[n-1];
+        if(ddy) *ddy=2.0*m_c[n-1];
+    } else {
+        // interpolation
+        if(y)   *y=((m_d[idx]*h + m_c[idx])*h + m_b[idx])*h + m_y[idx];
+        if(dy)  *dy=(3.0*m_d[idx]*h + 2.0*m_c[idx])*h + m_b[idx];
+        if(ddy) *ddy=6.0*m_d[idx]*h + 2.0*m_c[idx];
+    }
+}
+
+void spline::eval_sorted(const double* x, int n, double* y,
+                         double* dy, double* ddy) const
+{
+    size_t cursor=0;
+    for(int i=0; i<n; i++) {
+        eval_cursor(x[i], cursor, y ? y+i : NULL, dy ? dy+i : NULL,
+                    ddy ? ddy+i : NULL);
+    }
+}
+
 double spline::deriv(int order, double x) const
 {
     //assert(order>0);
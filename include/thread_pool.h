@@ -0,0 +1,59 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+/** Persistent pool of worker threads. The threads are created once and reused by every parallel_for call. 
+ * The calling thread takes part in the work, so parallel_for can also be called from inside a task. A worker waiting 
+ * for the tasks of its job claimed by other threads helps the jobs queued after its own one meanwhile. */
+class ThreadPool {
+
+private:
+    /** a parallel_for call: tasks 0 ... num_tasks - 1 are claimed one at a time through next */
+    struct Job {
+        const std::function<void(int)>* task;
+        int num_tasks;
+        long sequence;                                                  /** order of the job in the queue */
+        std::atomic<int> next;
+        std::atomic<int> done;
+    };
+
+    std::vector<std::thread> workers;                                   /** worker threads */
+    std::deque<std::shared_ptr<Job>> jobs;                              /** jobs with tasks still to be claimed */
+    std::mutex mutex;                                                   /** protects jobs and stop */
+    std::condition_variable job_available;                              /** signals a new job or the stop */
+    std::condition_variable job_finished;                               /** signals the completion of a job, or a new job 
+                                                                            to the workers waiting in parallel_for */
+    long sequence;                                                      /** jobs queued so far */
+    bool stop;                                                          /** stops the workers */
+
+    void worker_loop(int index);                                        /** loop executed by each worker */
+    bool run_one(Job& job);                                             /** claims and runs one task of the job, false if none is left */
+    void remove_job(const std::shared_ptr<Job>& job);                   /** removes the job from the queue */
+    std::shared_ptr<Job> job_after(long sequence);                      /** first job queued after sequence with tasks to be 
+                                                                            claimed, called with the mutex locked */
+
+public:
+    explicit ThreadPool(int num_threads = std::thread::hardware_concurrency());    // Constructor
+    ~ThreadPool();                                                                  // Destructor
+
+    int size() const;                                                               /** number of threads working on a job, caller included */
+    int thread_index() const;                                                       /** index in [0, size()) of the calling thread: 
+                                                                                        1 ... size() - 1 for the workers, 0 for any other thread */
+    void parallel_for(int num_tasks, const std::function<void(int)>& task);         /** runs task(0) ... task(num_tasks - 1) and waits for all of them */
+    template <class Task>
+    void parallel_for(int num_tasks, const Task& task)                              /** same with any callable, wrapped by reference so 
+                                                                                        that the call does not allocate its copy */
+    {
+        parallel_for(num_tasks, std::function<void(int)>(std::cref(task)));
+    }
+};
+
+#endif // THREAD_POOL_H
@@ -12,4 +12,35 @@ double square(double value);
 // Function to compute the dot product of two vectors (x1, y1) and (x2, y2)
 double dot_product(double x1, double y1, double x2, double y2);
 
+// Function to compute the sine and the cosine of an angle without branches or library calls, so that loops 
+// over arrays of angles are vectorised by the compiler. Defined inline for the same reason. 
+// Accurate to a few ulp for |angle| < 1e5 (Cody-Waite reduction, fdlibm kernel polynomials)
+inline void sincos_poly(double angle, double& sin_angle, double& cos_angle)
+{
+    const double two_over_pi = 6.36619772367581382433e-01;
+    const double pio2_1 = 1.57079632673412561417e+00;
+    const double pio2_2 = 6.07710050630396597660e-11;
+    const double pio2_3 = 2.02226624871116645580e-21;
+    const double round_magic = 6755399441055744.0;      // 1.5 * 2^52: adding and subtracting it rounds to an integer
+
+    // Reduction to r in [-pi/4, pi/4] and quadrant q:
+    double n = (angle * two_over_pi + round_magic) - round_magic;
+    int q = (int) n;
+    double r = ((angle - n * pio2_1) - n * pio2_2) - n * pio2_3;
+    double z = r * r;
+
+    // Polynomials on [-pi/4, pi/4]:
+    double sr = r + r * z * (-1.66666666666666324348e-01 + z * (8.33333333332248946124e-03 + z * (-1.98412698298579493134e-04 
+                + z * (2.75573137070700676789e-06 + z * (-2.50507602534068634195e-08 + z * 1.58969099521155010221e-10)))));
+    double cr = 1.0 - 0.5 * z + z * z * (4.16666666666666019037e-02 + z * (-1.38888888888741095749e-03 + z * (2.48015872894767294178e-05 
+                + z * (-2.75573143513906633035e-07 + z * (2.08757232129817482790e-09 + z * -1.13596475577881948265e-11)))));
+
+    // Quadrant, selected with exact products by 0, 1 and -1:
+    double odd = (double) (q & 1);
+    double sign_sin = 1.0 - (double) (q & 2);
+    double sign_cos = 1.0 - (double) ((q + 1) & 2);
+    sin_angle = sign_sin * (sr * (1.0 - odd) + cr * odd);
+    cos_angle = sign_cos * (cr * (1.0 - odd) + sr * odd);
+}
+
 #endif // UTILS_H
\ No newline at end of file
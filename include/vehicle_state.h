@@ -2,6 +2,7 @@
 #define VEHICLE_STATE_H
 
 #include <vector>
+#include <cmath>
 #include "spline.h"  // Include the third-party spline library
 
 struct TrajectoryPoint {
@@ -29,16 +30,59 @@ struct Lane {
     double s_max;                   /** Maximum longitudinal position in the lane */
     tk::spline spline_x;            /** Spline for x-coordinates */
     tk::spline spline_y;            /** Spline for y-coordinates */
+    double ds_table;                /** spacing in s of the lookup table */
+    double s_table;                 /** s of the first sample of the lookup table */
+    std::vector<double> table;      /** samples <x, y, dx/ds, dy/ds> of the splines every ds_table */
 
-    Lane() : present(false), s_max(0.0) {}  // Default constructor
+    Lane() : present(false), s_max(0.0), ds_table(0.25), s_table(0.0) {}  // Default constructor
 
     void initialize_spline(const std::vector<double>& x, 
                           const std::vector<double>& y, 
                           const std::vector<double>& s);
-    double compute_heading(double s);
-    double compute_curvature(double s);
+    double compute_heading(double s) const;
+    double compute_curvature(double s) const;
+    void lookup(double s, double& x, double& y, double& cos_psi, double& sin_psi) const;
 };
 
+/** position and unit tangent of the lane at s from the lookup table, in constant time: cubic Hermite interpolation 
+ * of the position, the tangent is the normalized derivative of the interpolant. The interpolant reproduces the cubic 
+ * pieces of the splines between samples, the error is only on the samples that enclose a knot. Outside the table the 
+ * splines are linear, so are the extrapolated values. Defined inline since it is called at each step of the rollouts */
+inline void Lane::lookup(double s, double& x, double& y, double& cos_psi, double& sin_psi) const
+{
+    const int n_samples = (int) table.size() / 4;
+    double u = (s - s_table) / ds_table;
+    double dx;
+    double dy;
+    if (u <= 0.0 || u >= n_samples - 1){
+        const double* p = (u <= 0.0) ? table.data() : table.data() + 4 * (n_samples - 1);
+        double h = (u <= 0.0) ? s - s_table : s - s_table - (n_samples - 1) * ds_table;
+        x = p[0] + p[2] * h;
+        y = p[1] + p[3] * h;
+        dx = p[2];
+        dy = p[3];
+    }else{
+        int idx = (int) u;
+        double t = u - idx;
+        const double* p0 = table.data() + 4 * idx;
+        const double* p1 = p0 + 4;
+        double h00 = (1.0 + 2.0 * t) * (1.0 - t) * (1.0 - t);
+        double h10 = t * (1.0 - t) * (1.0 - t) * ds_table;
+        double h01 = t * t * (3.0 - 2.0 * t);
+        double h11 = t * t * (t - 1.0) * ds_table;
+        double d00 = 6.0 * t * (t - 1.0) / ds_table;
+        double d10 = (t - 1.0) * (3.0 * t - 1.0);
+        double d11 = t * (3.0 * t - 2.0);
+        x = h00 * p0[0] + h10 * p0[2] + h01 * p1[0] + h11 * p1[2];
+        y = h00 * p0[1] + h10 * p0[3] + h01 * p1[1] + h11 * p1[3];
+        dx = d00 * (p0[0] - p1[0]) + d10 * p0[2] + d11 * p1[2];
+        dy = d00 * (p0[1] - p1[1]) + d10 * p0[3] + d11 * p1[3];
+    }
+    double norm = 1.0 / std::sqrt(dx * dx + dy * dy);
+    cos_psi = dx * norm;
+    sin_psi = dy * norm;
+}
+
 /** Vehicle state representation */
 struct VehicleState {
     double x;                               /** X position */
@@ -50,6 +94,7 @@ struct VehicleState {
     double L;                               /** length of the i-th vehicle */
     double W;                               /** width of the i-th vehicle */
     double v_target;                        /** target speed of the i-th vehicle */
+    int id;                                 /** stable identifier of the vehicle across planning cycles (-1 if unknown) */
 
     Lane centerlane;                        /** Center lane */
     Lane leftlane;                          /** Left lane */
@@ -58,8 +103,8 @@ struct VehicleState {
     Trajectory predicted_trajectory;        /** predicted trajectory*/
     Control predicted_control;              /** predicted control*/
 
-    VehicleState(double x_, double y_, double v_, double psi_, double beta_, double a_, double v_target_)
-        : x(x_), y(y_), v(v_), psi(psi_), beta(beta_), a(a_), v_target(v_target_) {}
+    VehicleState(double x_, double y_, double v_, double psi_, double beta_, double a_, double v_target_, int id_ = -1)
+        : x(x_), y(y_), v(v_), psi(psi_), beta(beta_), a(a_), v_target(v_target_), id(id_) {}
 };
 
 using TrafficParticipants = std::vector<VehicleState>;  // Alias for a list of vehicles
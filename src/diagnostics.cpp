@@ -0,0 +1,131 @@
+#include "diagnostics.h"
+#include "dynamic_game_planner.h"
+#include <sstream>
+#include <iomanip>
+#include <cstdint>
+
+void TextDiagnostics::solve_finished(const SolverState& state)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    out << "number of iterations: " << state.iterations << "\n";
+    out << "equilibrium residual: " << state.achieved_gradient_norm << "\n";
+}
+
+/** table of the trajectory of each vehicle */
+void TextDiagnostics::trajectories(const SolverState& state, int N, const double* X, const double* U)
+{
+    const int nX = 6;
+    const int nU = 2;
+    const int col_width = 12;
+    std::ostringstream text;                // the table is written at once, the formatting of out is not shared
+
+    for (int i = 0; i < state.M; i++){
+        text << "Vehicle: (" << state.traffic[i]->x << ", " << state.traffic[i]->y << ") \t" << state.traffic[i]->v << "\n";
+
+        // Table header with aligned columns:
+        text << std::left
+             << std::setw(col_width) << "X"
+             << std::setw(col_width) << "Y"
+             << std::setw(col_width) << "V"
+             << std::setw(col_width) << "PSI"
+             << std::setw(col_width) << "S"
+             << std::setw(col_width) << "L"
+             << std::setw(col_width) << "F"
+             << std::setw(col_width) << "d"
+             << "\n";
+        text << std::string(col_width * 8, '-') << "\n";
+
+        // Trajectory values:
+        for (int j = 0; j < N + 1; j++){
+            const double* X_j = &X[nX * (N + 1) * i + nX * j];
+            const double* U_j = &U[nU * (N + 1) * i + nU * j];
+            text << std::fixed << std::left;
+            for (int n = 0; n < nX; n++){
+                text << std::setw(col_width) << X_j[n];
+            }
+            text << std::setw(col_width) << U_j[1]
+                 << std::setw(col_width) << U_j[0]
+                 << "\n";
+        }
+        text << "\n";
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    out << text.str();
+}
+
+void TextDiagnostics::violations(const SolverState& /*state*/, const std::vector<ConstraintViolation>& violations)
+{
+    std::ostringstream text;
+    text << std::fixed;
+    for (const ConstraintViolation& violation : violations){
+        if (violation.other < 0){
+            text << "vehicle " << violation.vehicle << " violates lane constraints: " << violation.value << "\n";
+        }else{
+            text << "vehicle " << violation.vehicle << " violates collision avoidance constraints: " << violation.value << "\n";
+        }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    out << text.str();
+}
+
+void TextDiagnostics::planner_destroyed()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    out << "DynamicGamePlanner destroyed." << std::endl;
+}
+
+namespace {
+void write_int(std::ostream& out, int value)
+{
+    int32_t v = value;
+    out.write(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void write_doubles(std::ostream& out, const double* values, int count)
+{
+    out.write(reinterpret_cast<const char*>(values), sizeof(double) * count);
+}
+
+/** number of integration nodes minus one, from the size of the state vector */
+int horizon(const SolverState& state)
+{
+    return state.nX_ / (6 * state.M) - 1;
+}
+}
+
+void BinaryDiagnostics::solve_finished(const SolverState& state)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    write_int(out, solve_record);
+    write_int(out, state.M);
+    write_int(out, horizon(state));
+    write_int(out, state.iterations);
+    write_int(out, state.status);
+    write_doubles(out, &state.achieved_gradient_norm, 1);
+    write_doubles(out, &state.constraint_violation, 1);
+}
+
+void BinaryDiagnostics::trajectories(const SolverState& state, int N, const double* X, const double* U)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    write_int(out, trajectory_record);
+    write_int(out, state.M);
+    write_int(out, N);
+    write_doubles(out, X, 6 * (N + 1) * state.M);
+    write_doubles(out, U, 2 * (N + 1) * state.M);
+}
+
+void BinaryDiagnostics::violations(const SolverState& state, const std::vector<ConstraintViolation>& violations)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    write_int(out, violation_record);
+    write_int(out, state.M);
+    write_int(out, horizon(state));
+    write_int(out, violations.size());
+    for (const ConstraintViolation& violation : violations){
+        write_int(out, violation.vehicle);
+        write_int(out, violation.other);
+        write_int(out, violation.node);
+        write_doubles(out, &violation.value, 1);
+    }
+}
@@ -1,291 +1,1120 @@
 #include "dynamic_game_planner.h"
 #include <iostream>
+#include <cstring>
+#include <limits>
+#include <algorithm>
 
-DynamicGamePlanner::DynamicGamePlanner() 
+template <int N_>
+DynamicGamePlanner<N_>::DynamicGamePlanner() 
+    : thread_pool(std::make_shared<ThreadPool>())
 {
 }
 
-DynamicGamePlanner::~DynamicGamePlanner() {
-    // Destructor implementation
-    std::cout << "DynamicGamePlanner destroyed." << std::endl;
+template <int N_>
+DynamicGamePlanner<N_>::DynamicGamePlanner(std::shared_ptr<ThreadPool> thread_pool_) 
+    : thread_pool(thread_pool_)
+{
+}
+
+template <int N_>
+DynamicGamePlanner<N_>::~DynamicGamePlanner() {
+    diagnostics->planner_destroyed();
+}
+
+template <int N_>
+void DynamicGamePlanner<N_>::run(TrafficParticipants& traffic_state) const {
+    SolverState state;
+    run(traffic_state, state);
+}
+
+template <int N_>
+void DynamicGamePlanner<N_>::run(TrafficParticipants& traffic_state, SolverState& state, double elapsed_time, double time_budget) const {
+    solve(traffic_state, state, elapsed_time, time_budget);
+    std::chrono::steady_clock::time_point prediction_start = std::chrono::steady_clock::now();
+    set_prediction(state, state.workspace.X.data(), state.workspace.U.data(), traffic_state);
+    state.output_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - prediction_start).count();
 }
 
-void DynamicGamePlanner::run(TrafficParticipants& traffic_state) {
+/** run() without the predictions. The vehicles are read through state.traffic from traffic_state, nothing is copied: 
+ * with the same SolverState and number of vehicles a solve does not allocate */
+template <int N_>
+void DynamicGamePlanner<N_>::solve(const TrafficParticipants& traffic_state, SolverState& state, double elapsed_time, double time_budget) const {
     
-    traffic = traffic_state;
+    state.start_time = std::chrono::steady_clock::now();
+    state.time_budget = time_budget;
+    state.traffic.resize(traffic_state.size());
+    for (size_t i = 0; i < traffic_state.size(); i++){
+        state.traffic[i] = &traffic_state[i];
+    }
 
     // Variables initialization and setup:
-    setup();
+    setup(state);
+    PROFILE(state.stats.reset(state.M));
 
     // definition of the control variable vector U and of the state vector X:
-    double U[nU_];
-    double X[nX_];
-    double constraints[nC];
+    double* U = state.workspace.U.data();
+    double* X = state.workspace.X.data();
+
+    // Multi-resolution: the game is solved first on the coarse level, which warm starts itself, within the same deadline:
+    if (coarse_level){
+        state.coarse.resize(1);
+        coarse_level(traffic_state, state.coarse[0], elapsed_time, (time_budget > 0.0) ? std::max(remaining_time(state), 1e-9) : 0.0);
+    }else{
+        state.coarse.clear();
+    }
+
+    // Groups of vehicles that cannot interact are separate games:
+    if (decompose_interactions == true && interaction_components(state) > 1){
+        solve_components(state, U, elapsed_time);
+    }else{
+        state.components.clear();
+        initial_guess(state, X, U);
+        update_broad_phase(state, X);
+        if (coarse_level){
+            coarse_guess(state, state.coarse[0], nullptr, X, U);
+        }else if (warm_start == true){
+            warm_start_guess(state, X, U, elapsed_time);
+        }
+        solve_game(state, U);
+    }
+    std::chrono::steady_clock::time_point output_start = std::chrono::steady_clock::now();
+    diagnostics->solve_finished(state);
+    save_warm_start(state, U);
+    integrate(state, X, U);
+    if (diagnostics->wants_trajectories()){
+        diagnostics->trajectories(state, N, X, U);
+    }
+
+    // The constraints of the solution are checked only for the diagnostics:
+    if (diagnostics->wants_violations()){
+        update_broad_phase(state, X);
+        double* constraints = state.workspace.constraints.data();
+        compute_constraints(state, constraints, X);
+        compute_violations(state, constraints, state.workspace.violations);
+        diagnostics->violations(state, state.workspace.violations);
+    }
+    state.output_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - output_start).count();
+    PROFILE(state.stats.collect());
+}
+
+/** solves num_scenes independent games, each as run() without warm start. The scenes are tasks of the thread 
+ * pool, the largest first: each thread solves whole scenes with its own SolverState, reused from one scene to the 
+ * next, and calls parallel_for inside the scene as run() does. Once all the scenes are taken, the threads left idle 
+ * take the chunks of the gradients and of the steps of the scenes still running, so the pool stays busy with small 
+ * and large scenes */
+template <int N_>
+void DynamicGamePlanner<N_>::solve_batch(TrafficParticipants* scenes, int num_scenes, std::vector<SceneResult>& results, double time_budget) const {
+
+    std::vector<SolverState> states(thread_pool->size());
+    std::vector<int> order(num_scenes);
+    results.resize(num_scenes);
+
+    // Largest scenes first, the small ones fill the end of the batch:
+    for (int n = 0; n < num_scenes; n++){
+        order[n] = n;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return scenes[a].size() > scenes[b].size(); });
+
+    thread_pool->parallel_for(num_scenes, [&](int task) {
+        const int n = order[task];
+        SolverState& state = states[thread_pool->thread_index()];
+        SceneResult& result = results[n];
+
+        // The scenes are independent, nothing is warm started from the previous one, on any level:
+        state.M_old = 0;
+        for (SolverState* level = &state; !level->coarse.empty(); level = &level->coarse[0]){
+            level->coarse[0].M_old = 0;
+        }
+        run(scenes[n], state, 0.0, time_budget);
+
+        result.status = state.status;
+        result.iterations = state.iterations;
+        result.achieved_gradient_norm = state.achieved_gradient_norm;
+        result.constraint_violation = state.constraint_violation;
+        result.gradient_evaluations = state.gradient_evaluations;
+        result.subproblem_iterations = state.subproblem_iterations;
+        result.cache_hits = state.cache_hits;
+        result.solve_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - state.start_time).count();
+        result.stats = state.stats;
+    });
+}
+
+/** interaction graph of the vehicles: two vehicles are connected if their reachable sets over the horizon can get 
+ * closer than r_safe. The reachable set of a vehicle is bounded by a disc around its position, whose radius bounds 
+ * the distance travelled with the largest force from the current speed. The components are numbered in the order 
+ * of their first vehicle, returns the number of components */
+template <int N_>
+int DynamicGamePlanner<N_>::interaction_components(SolverState& state) const
+{
+    Workspace& ws = state.workspace;
+    const int M = state.M;
+    std::vector<int>& component = state.component;
+    double* reach = ws.reach.data();
+    double v_bound;
+    double dx;
+    double dy;
+    double r;
+    int a;
+    int b;
+    int num_components = 0;
+
+    // Radius of the reachable sets, the speed grows at most as v += dt * (- v / tau + k * F_up) and saturates at zero:
+    for (int i = 0; i < M; i++){
+        v_bound = std::abs(state.traffic[i]->v);
+        reach[i] = 0.0;
+        for (int j = 0; j < N + 1; j++){
+            reach[i] += dt * v_bound;
+            v_bound = std::abs(1.0 - dt / tau) * v_bound + dt * k * std::max(F_up, 0.0);
+        }
+    }
+
+    // Union-find of the connected vehicles, the root of a component is its first vehicle:
+    auto root = [&](int i) {
+        while (component[i] != i){
+            component[i] = component[component[i]];
+            i = component[i];
+        }
+        return i;
+    };
+    component.resize(M);
+    for (int i = 0; i < M; i++){
+        component[i] = i;
+    }
+    for (int i = 0; i < M; i++){
+        for (int k_ = i + 1; k_ < M; k_++){
+            dx = state.traffic[i]->x - state.traffic[k_]->x;
+            dy = state.traffic[i]->y - state.traffic[k_]->y;
+            r = reach[i] + reach[k_] + r_safe + collision_margin;
+            if (dx * dx + dy * dy < r * r){
+                a = root(i);
+                b = root(k_);
+                if (a != b){
+                    component[std::max(a, b)] = std::min(a, b);
+                }
+            }
+        }
+    }
+    for (int i = 0; i < M; i++){
+        component[i] = root(i);
+    }
+    for (int i = 0; i < M; i++){
+        a = component[i];
+        component[i] = (a == i) ? num_components++ : component[a];
+    }
+
+    // Vehicles of each component, and components from the largest:
+    ws.members.clear();
+    ws.component_start.clear();
+    for (int c = 0; c < num_components; c++){
+        ws.component_start.push_back(ws.members.size());
+        for (int i = 0; i < M; i++){
+            if (component[i] == c){
+                ws.members.push_back(i);
+            }
+        }
+    }
+    ws.component_start.push_back(M);
+    ws.component_order.resize(num_components);
+    for (int c = 0; c < num_components; c++){
+        ws.component_order[c] = c;
+    }
+    std::sort(ws.component_order.begin(), ws.component_order.end(), [&](int c0, int c1) {
+        int size0 = ws.component_start[c0 + 1] - ws.component_start[c0];
+        int size1 = ws.component_start[c1 + 1] - ws.component_start[c1];
+        return size0 > size1 || (size0 == size1 && c0 < c1);            // stable without the buffer of std::stable_sort
+    });
+    return num_components;
+}
+
+/** solves the game of each component with its own SolverState, the components run in parallel from the largest. 
+ * The games are warm started from the previous solution of the whole game, the vehicles are matched by id, or start 
+ * from the solution of the coarse level. The solutions, collision blocks and lagrangian multipliers are merged in 
+ * state as if the game was solved as a whole */
+template <int N_>
+void DynamicGamePlanner<N_>::solve_components(SolverState& state, double* U_, double elapsed_time) const
+{
+    Workspace& ws = state.workspace;
+    const int M = state.M;
+    const int num_components = ws.component_start.size() - 1;
+    int start;
+    int start_c;
+    int row;
+    state.components.resize(num_components);
+
+    thread_pool->parallel_for(num_components, [&](int task) {
+        const int c = ws.component_order[task];
+        SolverState& game = state.components[c];
+        game.traffic.clear();
+        for (int m = ws.component_start[c]; m < ws.component_start[c + 1]; m++){
+            game.traffic.push_back(state.traffic[ws.members[m]]);
+        }
+        game.start_time = state.start_time;
+        game.time_budget = state.time_budget;
+        game.output_time = state.output_time;
+        game.M_old = state.M_old;
+        game.U_old = state.U_old;
+        game.id_old = state.id_old;
+        game.lagrangian_multipliers_old = state.lagrangian_multipliers_old;
+        game.blocks_old = state.blocks_old;
+        game.block_start_old = state.block_start_old;
+        game.constraint_start_old = state.constraint_start_old;
+
+        setup(game);
+        PROFILE(game.stats.reset(game.M));
+        double* U = game.workspace.U.data();
+        double* X = game.workspace.X.data();
+        initial_guess(game, X, U);
+        update_broad_phase(game, X);
+        if (coarse_level){
+            coarse_guess(game, state.coarse[0], &ws.members[ws.component_start[c]], X, U);
+        }else if (warm_start == true){
+            warm_start_guess(game, X, U, elapsed_time);
+        }
+        solve_game(game, U);
+    });
+
+    // Solutions and near pairs of the components:
+    state.status = converged;
+    state.iterations = 0;
+    state.achieved_gradient_norm = 0.0;
+    state.constraint_violation = 0.0;
+    state.gradient_evaluations = 0;
+    state.agent_gradient_evaluations = 0;
+    state.subproblem_iterations = 0;
+    state.cache_hits = 0;
+    for (int c = 0; c < num_components; c++){
+        const SolverState& game = state.components[c];
+        const int* members = &ws.members[ws.component_start[c]];
+        for (int a = 0; a < game.M; a++){
+            for (int n = 0; n < nu; n++){
+                U_[nu * members[a] + n] = game.workspace.U[nu * a + n];
+            }
+            for (int b = 0; b < game.M; b++){
+                for (int w = 0; w < nW; w++){
+                    state.near_pairs[(M * members[a] + members[b]) * nW + w] = game.near_pairs[(game.M * a + b) * nW + w];
+                }
+            }
+        }
+        if (game.status == deadline_reached || (game.status == iteration_limit && state.status == converged)){
+            state.status = game.status;
+        }
+        state.iterations = std::max(state.iterations, game.iterations);
+        state.achieved_gradient_norm = std::max(state.achieved_gradient_norm, game.achieved_gradient_norm);
+        state.constraint_violation = std::max(state.constraint_violation, game.constraint_violation);
+        state.gradient_evaluations += game.gradient_evaluations;
+        state.agent_gradient_evaluations += game.agent_gradient_evaluations;
+        state.subproblem_iterations += game.subproblem_iterations;
+        state.cache_hits += game.cache_hits;
+        state.gradient_time = std::max(state.gradient_time, game.gradient_time);
+        state.rho = std::max(state.rho, game.rho);
+        PROFILE(state.stats.merge(game.stats, members));
+    }
 
-    initial_guess(X, U);
-    trust_region_solver(U);
-    integrate(X, U);
-    print_trajectories(X, U);
-    compute_constraints(constraints, X, U);
-    constraints_diagnostic(constraints, false);
-    traffic = set_prediction(X, U);
+    // Collision blocks and lagrangian multipliers of the whole game:
+    update_constraint_blocks(state);
+    for (int c = 0; c < num_components; c++){
+        const SolverState& game = state.components[c];
+        const int* members = &ws.members[ws.component_start[c]];
+        for (int a = 0; a < game.M; a++){
+            start = state.constraint_start[members[a]];
+            start_c = game.constraint_start[a];
+            for (int r = 0; r < nF; r++){
+                state.lagrangian_multipliers[start + r] = game.lagrangian_multipliers[start_c + r];
+            }
+            for (int b = game.block_start[a]; b < game.block_start[a + 1]; b++){
+                const CollisionBlock& block = game.blocks[b];
+                row = collision_row(state.blocks, state.block_start[members[a]], state.block_start[members[a] + 1], 
+                                    members[block.k], nB * block.w);
+                for (int r = 0; r < std::min(nB, N + 1 - nB * block.w); r++){
+                    state.lagrangian_multipliers[start + row + r] = game.lagrangian_multipliers[start_c + block.row + r];
+                }
+            }
+        }
+    }
 }
 
-void DynamicGamePlanner::setup() {
+template <int N_>
+void DynamicGamePlanner<N_>::setup(SolverState& state) const {
     
     // Setup number of traffic participants:
-    M = traffic.size();
+    state.M = state.traffic.size();
     
-    // Setup number of inequality constraints for one vehicle:
-    // 2 * nU * (N + 1) inequality constraints for inputs 
-    // (N + 1) * (M - 1) collision avoidance constraints
-    // (N + 1) constraints to remain in the lane
-    nC_i = 2 * nU * (N + 1) + (N + 1) * (M - 1) + (N + 1);
-
-    // Setup number of inequality constraints for all the traffic participants
-    nC = nC_i * M;
+    // Setup maximum number of inequality constraints for one vehicle:
+    // (N + 1) constraints to remain in the lane, the bounds of the inputs are kept by the trust region steps
+    // up to (N + 1) * (M - 1) collision avoidance constraints, only the near pairs are stored
+    state.nC_i = nF + (N + 1) * (state.M - 1);
 
     // Setup number of elements in the state vector X:
     // number of state variables * number of timesteps * number of traffic participants
-    nX_ = nX * (N + 1) * M;
+    state.nX_ = nX * (N + 1) * state.M;
 
     // Setup number of elements in the control vector U:
     // number of control variables * number of timesteps * number of traffic participants
-    nU_ = nU * (N + 1) * M;
+    state.nU_ = nU * (N + 1) * state.M;
 
     // Setup length of the gradient vector G:
-    nG = nU_;
+    state.nG = state.nU_;
+
+    // Reset the penalty weight:
+    state.rho = rho;
 
     // resize and initialize limits for control input
-    ul.resize(nU * (N + 1), 1);
-    uu.resize(nU * (N + 1), 1);
+    state.ul.resize(nU * (N + 1), 1);
+    state.uu.resize(nU * (N + 1), 1);
     for (int j = 0; j < N + 1; j++){
-        ul(nU * j + d, 0) = d_low;
-        uu(nU * j + d, 0) = d_up;
-        ul(nU * j + F, 0) = F_low;
-        uu(nU * j + F, 0) = F_up;
+        state.ul(nU * j + d, 0) = d_low;
+        state.uu(nU * j + d, 0) = d_up;
+        state.ul(nU * j + F, 0) = F_low;
+        state.uu(nU * j + F, 0) = F_up;
+    }
+
+    // lane constraints with zero lagrangian multipliers, the collision blocks are added by the broad phase:
+    state.near_pairs.assign(state.M * state.M * nW, 0);
+    state.blocks.clear();
+    state.block_start.assign(state.M + 1, 0);
+    state.constraint_start.resize(state.M + 1);
+    for (int i = 0; i < state.M + 1; i++){
+        state.constraint_start[i] = nF * i;
     }
+    state.nC = nF * state.M;
+    state.lagrangian_multipliers.assign(state.nC, 0.0);
 
-    // resize time vector
-    time.resize(N + 1, 1);
+    // buffers of the solve:
+    allocate_workspace(state);
 
-    // resize and initialize lagrangian multiplier vector
-    lagrangian_multipliers.resize(nC, 1);
-    lagrangian_multipliers = Eigen::MatrixXd::Zero(nC, 1);
+}
 
+/** sizes the buffers of the workspace. Nothing is allocated if the number of agents and of threads did not change */
+template <int N_>
+void DynamicGamePlanner<N_>::allocate_workspace(const SolverState& state) const
+{
+    Workspace& ws = state.workspace;
+    if (ws.M == state.M && ws.num_threads == thread_pool->size()){
+        return;
+    }
+    ws.M = state.M;
+    ws.num_threads = thread_pool->size();
+    ws.scratch_size = state.nU_ + state.nX_ + 2 * state.nC_i + nx * lanes;
+
+    ws.U.resize(state.nU_);
+    ws.X.resize(state.nX_);
+    ws.match.resize(state.M);
+
+    ws.gradient.resize(state.nG);
+    ws.d_gradient.resize(state.nG);
+    ws.dU.resize(state.nU_);
+    ws.dU_.resize(state.nU_);
+    ws.dX.resize(state.nX_);
+    ws.dX_.resize(state.nX_);
+    ws.lagrangian.resize(state.M);
+    ws.d_lagrangian.resize(state.M);
+    ws.actual_reduction.resize(state.M);
+    ws.predicted_reduction.resize(state.M);
+    ws.delta.resize(state.M);
+    ws.subproblem_iterations.resize(state.M);
+    ws.agent_gradients.resize(state.M);
+    ws.U_response.resize(state.nU_);
+    ws.s_.resize(nu * state.M);
+    ws.U_best.resize(state.nU_);
+
+    ws.positions.resize(2 * (N + 1) * state.M);
+    ws.reach.resize(state.M);
+
+    ws.X_gradient.resize(state.nX_);
+    ws.lagrangian_gradient.resize(state.M);
+    ws.cost.resize(state.nU_);
+    ws.bounds.reserve(4 * ws.num_threads + 1);
+
+    ws.cache_U.resize(cache_entries * state.nU_);
+    ws.cache_X.resize(cache_entries * state.nX_);
+    ws.cache_lagrangian.resize(cache_entries * state.M);
+    ws.cache_gradient.resize(cache_entries * state.nG);
+    ws.cache_epoch_lagrangian.resize(cache_entries);
+    ws.cache_epoch_gradient.resize(cache_entries);
+    ws.cache_last_use.resize(cache_entries);
+
+    ws.scratch.resize(ws.scratch_size * ws.num_threads);
 }
 
 /** Sets the intial guess of the game */
-void DynamicGamePlanner::initial_guess(double* X_, double* U_)
+template <int N_>
+void DynamicGamePlanner<N_>::initial_guess(const SolverState& state, double* X_, double* U_) const
 {
-    for (int i = 0; i < M; i++){
+    for (int i = 0; i < state.M; i++){
         for (int j = 0; j < N + 1; j++){
             U_[nU * (N + 1) * i + nU * j + d] = 0.0;
             U_[nU * (N + 1) * i + nU * j + F] = 0.3;
         }
     }
-    integrate(X_, U_);
+    integrate(state, X_, U_);
+}
+
+/** Replaces the initial guess of the vehicles already present in the previous run with their previous solution shifted 
+ * by elapsed_time. The vehicles are matched by id, new vehicles keep the initial guess */
+template <int N_>
+void DynamicGamePlanner<N_>::warm_start_guess(SolverState& state, double* X_, double* U_, double elapsed_time) const
+{
+    int* match = state.workspace.match.data();
+
+    if (state.U_old.empty()){
+        return;
+    }
+
+    // Match the vehicles with the previous run:
+    for (int i = 0; i < state.M; i++){
+        match[i] = -1;
+        if (state.traffic[i]->id < 0){
+            continue;
+        }
+        for (int k = 0; k < state.M_old; k++){
+            if (state.id_old[k] == state.traffic[i]->id){
+                match[i] = k;
+                break;
+            }
+        }
+    }
+    interpolate_guess(state, state, X_, U_, elapsed_time);
+}
+
+/** Replaces the initial guess with the solution of the coarse level of the run, interpolated on the nodes of this 
+ * level, and starts from its penalty weight. The coarse level solved all the vehicles of the run in the same order, 
+ * members maps the vehicles of a component to them */
+template <int N_>
+void DynamicGamePlanner<N_>::coarse_guess(SolverState& state, const SolverState& coarse, const int* members, double* X_, double* U_) const
+{
+    int* match = state.workspace.match.data();
+    for (int i = 0; i < state.M; i++){
+        match[i] = (members == nullptr) ? i : members[i];
+    }
+
+    // The penalty weight goes on from the coarse level, the multipliers are interpolated:
+    state.rho = coarse.rho;
+    interpolate_guess(state, coarse, X_, U_, 0.0);
+}
+
+/** Replaces the initial guess of the vehicles matched in the workspace with the solution saved in previous, at the time 
+ * of each node plus elapsed_time. The saved solution can have another step and number of nodes, it is interpolated 
+ * linearly and held outside its horizon: the input j acts from the time j * dt and the state j is reached at the time 
+ * (j + 1) * dt. The lagrangian multipliers are interpolated as the states, the ones of unmatched vehicles and of 
+ * collision blocks not stored in the saved solution are zero */
+template <int N_>
+void DynamicGamePlanner<N_>::interpolate_guess(SolverState& state, const SolverState& previous, double* X_, double* U_, double elapsed_time) const
+{
+    int i_old;
+    int k_old;
+    int j0;
+    int j1;
+    int row0;
+    int row1;
+    int start;
+    int start_old;
+    double t;
+    double a;
+    const int N_old = previous.N_old;
+    const int nu_old = nU * (N_old + 1);
+    const int* match = state.workspace.match.data();
+
+    if (previous.U_old.empty()){
+        return;
+    }
+
+    // Input (offset 0) or state (offset 1) j of this horizon lies between the nodes j0 and j1 of the saved one:
+    auto shift = [&](int j, int offset) {
+        t = std::min(std::max(((j + offset) * dt + elapsed_time) / previous.dt_old - offset, 0.0), (double) N_old);
+        j0 = (int) t;
+        j1 = std::min(j0 + 1, N_old);
+        a = t - j0;
+    };
+
+    // Controls:
+    for (int i = 0; i < state.M; i++){
+        i_old = match[i];
+        if (i_old < 0){
+            continue;
+        }
+        for (int j = 0; j < N + 1; j++){
+            shift(j, 0);
+            for (int n = 0; n < nU; n++){
+                U_[nu * i + nU * j + n] = (1.0 - a) * previous.U_old[nu_old * i_old + nU * j0 + n] + a * previous.U_old[nu_old * i_old + nU * j1 + n];
+            }
+        }
+    }
+    integrate(state, X_, U_);
+
+    // Collision blocks of the interpolated solution:
+    update_broad_phase(state, X_);
+
+    for (int i = 0; i < state.M; i++){
+        i_old = match[i];
+        if (i_old < 0){
+            continue;
+        }
+        start = state.constraint_start[i];
+        start_old = previous.constraint_start_old[i_old];
+        for (int j = 0; j < N + 1; j++){
+            shift(j, 1);
+
+            // Multipliers of the lane constraints:
+            state.lagrangian_multipliers[start + j] = 
+                (1.0 - a) * previous.lagrangian_multipliers_old[start_old + j0] 
+                + a * previous.lagrangian_multipliers_old[start_old + j1];
+        }
+
+        // Multipliers of the collision avoidance constraints:
+        for (int b = state.block_start[i]; b < state.block_start[i + 1]; b++){
+            const CollisionBlock& block = state.blocks[b];
+            k_old = match[block.k];
+            if (k_old < 0){
+                continue;
+            }
+            for (int j = nB * block.w; j < std::min(nB * (block.w + 1), N + 1); j++){
+                shift(j, 1);
+                row0 = collision_row(previous.blocks_old, previous.block_start_old[i_old], previous.block_start_old[i_old + 1], k_old, j0);
+                row1 = collision_row(previous.blocks_old, previous.block_start_old[i_old], previous.block_start_old[i_old + 1], k_old, j1);
+                state.lagrangian_multipliers[start + block.row + j - nB * block.w] = 
+                    (1.0 - a) * ((row0 < 0) ? 0.0 : previous.lagrangian_multipliers_old[start_old + row0]) 
+                    + a * ((row1 < 0) ? 0.0 : previous.lagrangian_multipliers_old[start_old + row1]);
+            }
+        }
+    }
+}
+
+/** saves the solution, the vehicle identifiers and the lagrangian multipliers for the next warm start */
+template <int N_>
+void DynamicGamePlanner<N_>::save_warm_start(SolverState& state, const double* U_) const
+{
+    state.M_old = state.M;
+    state.N_old = N;
+    state.dt_old = dt;
+    state.U_old.assign(U_, U_ + state.nU_);
+    state.id_old.resize(state.M);
+    for (int i = 0; i < state.M; i++){
+        state.id_old[i] = state.traffic[i]->id;
+    }
+    state.lagrangian_multipliers_old = state.lagrangian_multipliers;
+    state.blocks_old = state.blocks;
+    state.block_start_old = state.block_start;
+    state.constraint_start_old = state.constraint_start;
+}
+
+/** row of the collision avoidance constraint with vehicle k at node j among the blocks begin ... end - 1 of a vehicle, 
+ * -1 if the pair is not stored at that node. The blocks are sorted by vehicle and window */
+template <int N_>
+int DynamicGamePlanner<N_>::collision_row(const std::vector<CollisionBlock>& blocks, int begin, int end, int k, int j) const
+{
+    int w = j / nB;
+    while (begin < end){
+        int mid = (begin + end) / 2;
+        const CollisionBlock& block = blocks[mid];
+        if (block.k == k && block.w == w){
+            return block.row + j - nB * w;
+        }
+        if (block.k < k || (block.k == k && block.w < w)){
+            begin = mid + 1;
+        }else{
+            end = mid;
+        }
+    }
+    return -1;
 }
 
 /** integrates the input U to get the state X */
-void DynamicGamePlanner::integrate(double* X_, const double* U_)
+template <int N_>
+void DynamicGamePlanner<N_>::integrate(const SolverState& state, double* X_, const double* U_) const
+{
+    PROFILE_PHASE(state.stats, integrate);
+    PROFILE(state.stats.rollouts += state.M);
+    for (int i = 0; i < state.M; i++){
+        integrate_vehicle_i(state, X_, U_, i, 0);
+    }
+}
+
+/** integrates the input U of vehicle i from node j_start onward, the nodes before j_start are kept from X */
+template <int N_>
+void DynamicGamePlanner<N_>::integrate_vehicle_i(const SolverState& state, double* X_, const double* U_, int i, int j_start) const
 {
     int tu;
     int td;
-    int ind;
     double s_ref;
-    double t;
     double s_t0[nX];
-    double sr_t0[nX];
+    double sr_t0[nR];
     double u_t0[nU];
     double ds_t0[nX];
 
-    for (int i = 0; i < M; i++){
-        ind = 0;
-        td = nx * i;
-        t = 0.0;
-
-        // Initial state:
-        s_t0[x] = traffic[i].x;
-        s_t0[y] = traffic[i].y;
-        s_t0[v] = traffic[i].v;
-        s_t0[psi] = traffic[i].psi;
+    // Initial state:
+    if (j_start == 0){
+        s_t0[x] = state.traffic[i]->x;
+        s_t0[y] = state.traffic[i]->y;
+        s_t0[v] = state.traffic[i]->v;
+        s_t0[psi] = state.traffic[i]->psi;
         s_t0[s] = 0.0;
         s_t0[l] = 0.0;
+    }else{
+        td = nX * (N + 1) * i + nX * (j_start - 1);
+        s_t0[x] = X_[td + x];
+        s_t0[y] = X_[td + y];
+        s_t0[v] = X_[td + v];
+        s_t0[psi] = X_[td + psi];
+        s_t0[s] = X_[td + s];
+        s_t0[l] = X_[td + l];
+    }
 
-        for (int j = 0; j < N + 1; j++){
-            tu = nU * (N + 1) * i + nU * j;
-            td = nX * (N + 1) * i + nX * j;
-
-            // Reference point on the center lane:
-            s_ref = s_t0[s];
-            sr_t0[x] = traffic[i].centerlane.spline_x(s_ref);
-            sr_t0[y] =traffic[i].centerlane.spline_y(s_ref);
-            sr_t0[psi] = traffic[i].centerlane.compute_heading(s_ref);
-            sr_t0[v] = traffic[i].v +  j * (traffic[i].v_target - traffic[i].v) / N; 
-
-            // Input control:
-            u_t0[d] = U_[tu + d];
-            u_t0[F] = U_[tu + F];
-            
-            // Dynamic step: 
-            dynamic_step(ds_t0, s_t0, sr_t0, u_t0);
+    for (int j = j_start; j < N + 1; j++){
+        tu = nU * (N + 1) * i + nU * j;
+        td = nX * (N + 1) * i + nX * j;
+
+        // Reference point on the center lane:
+        s_ref = s_t0[s];
+        state.traffic[i]->centerlane.lookup(s_ref, sr_t0[x_ref], sr_t0[y_ref], sr_t0[cos_ref], sr_t0[sin_ref]);
+        sr_t0[v_ref] = state.traffic[i]->v +  j * (state.traffic[i]->v_target - state.traffic[i]->v) / N; 
+
+        // Input control:
+        u_t0[d] = U_[tu + d];
+        u_t0[F] = U_[tu + F];
+        
+        // Dynamic step: 
+        dynamic_step(ds_t0, s_t0, sr_t0, u_t0);
+
+        // Integration to compute the new state: 
+        s_t0[x] += dt * ds_t0[x];
+        s_t0[y] += dt * ds_t0[y];
+        s_t0[v] += dt * ds_t0[v];
+        s_t0[psi] += dt * ds_t0[psi];
+        s_t0[s] += dt * ds_t0[s];
+        s_t0[l] += dt * ds_t0[l];
+
+        if (s_t0[v] < 0.0){s_t0[v] = 0.0;}
+
+        // Save the state in the trajectory
+        X_[td + x] = s_t0[x];
+        X_[td + y] = s_t0[y];
+        X_[td + v] = s_t0[v];
+        X_[td + psi] = s_t0[psi];
+        X_[td + s] = s_t0[s];
+        X_[td + l] = s_t0[l];
+    }
+}
+
+/** integrates lanes copies of vehicle i from node j_start onward, starting from the state stored in X at node j_start - 1. 
+ * Copy w uses the input U with U[perturbed[w]] increased by eps (no perturbation if perturbed[w] < 0). The states are 
+ * stored as structure of arrays, one lane per copy, and the dynamic step uses sincos_poly so that the loops over the 
+ * lanes are vectorised. The reference point on the center lane is evaluated for each lane */
+template <int N_>
+void DynamicGamePlanner<N_>::integrate_vehicle_i_lanes(const SolverState& state, double* X_lanes, const double* X_, 
+                                                       const double* U_, const int* perturbed, int i, int j_start) const
+{
+    int tu;
+    int td;
+    double s_t0[nX][lanes];
+    double sr_t0[nR][lanes];
+    double u_t0[nU][lanes];
+    double sin_a[lanes];
+    double cos_a[lanes];
+    double sin_psi[lanes];
+    double cos_psi[lanes];
+    double sin_d[lanes];
+    double cos_d[lanes];
+    double cos_cd[lanes];
+    double sin_cd[lanes];
+    const Lane& centerlane = state.traffic[i]->centerlane;
+
+    double s_init[nX];
+
+    // Initial state:
+    if (j_start == 0){
+        s_init[x] = state.traffic[i]->x;
+        s_init[y] = state.traffic[i]->y;
+        s_init[v] = state.traffic[i]->v;
+        s_init[psi] = state.traffic[i]->psi;
+        s_init[s] = 0.0;
+        s_init[l] = 0.0;
+    }else{
+        td = nx * i + nX * (j_start - 1);
+        for (int n = 0; n < nX; n++){
+            s_init[n] = X_[td + n];
+        }
+    }
+    for (int n = 0; n < nX; n++){
+        for (int w = 0; w < lanes; w++){
+            s_t0[n][w] = s_init[n];
+        }
+    }
 
-            // Integration to compute the new state: 
-            s_t0[x] += dt * ds_t0[x];
-            s_t0[y] += dt * ds_t0[y];
-            s_t0[v] += dt * ds_t0[v];
-            s_t0[psi] += dt * ds_t0[psi];
-            s_t0[s] += dt * ds_t0[s];
-            s_t0[l] += dt * ds_t0[l];
+    for (int j = j_start; j < N + 1; j++){
+        tu = nu * i + nU * j;
 
-            if (s_t0[v] < 0.0){s_t0[v] = 0.0;}
+        // Reference point on the center lane and input control of each lane:
+        for (int w = 0; w < lanes; w++){
+            centerlane.lookup(s_t0[s][w], sr_t0[x_ref][w], sr_t0[y_ref][w], sr_t0[cos_ref][w], sr_t0[sin_ref][w]);
+            sr_t0[v_ref][w] = state.traffic[i]->v +  j * (state.traffic[i]->v_target - state.traffic[i]->v) / N; 
+            u_t0[d][w] = U_[tu + d] + ((perturbed[w] == tu + d) ? eps : 0.0);
+            u_t0[F][w] = U_[tu + F] + ((perturbed[w] == tu + F) ? eps : 0.0);
+        }
 
-            // Save the state in the trajectory
-            X_[td + x] = s_t0[x];
-            X_[td + y] = s_t0[y];
-            X_[td + v] = s_t0[v];
-            X_[td + psi] = s_t0[psi];
-            X_[td + s] = s_t0[s];
-            X_[td + l] = s_t0[l];
+        // Dynamic step and integration, vectorised over the lanes:
+        for (int w = 0; w < lanes; w++){
+            sincos_poly(s_t0[psi][w] + cg_ratio * u_t0[d][w], sin_a[w], cos_a[w]);
+            sincos_poly(s_t0[psi][w], sin_psi[w], cos_psi[w]);
+            sincos_poly(u_t0[d][w], sin_d[w], cos_d[w]);
+            sincos_poly(cg_ratio * u_t0[d][w], sin_cd[w], cos_cd[w]);
+        }
+        for (int w = 0; w < lanes; w++){
+            double v_ = s_t0[v][w];
+            double dx_ = v_ * cos_a[w];
+            double dy_ = v_ * sin_a[w];
+            double dv_ = (-1/tau) * v_ + (k) * u_t0[F][w];
+            double dpsi_ = v_ * (sin_d[w] / cos_d[w]) * cos_cd[w] / length;
+            double dl_ = weight_target_speed * (v_ - sr_t0[v_ref][w]) * (v_ - sr_t0[v_ref][w])
+                + weight_center_lane * ((sr_t0[x_ref][w] - s_t0[x][w]) * (sr_t0[x_ref][w] - s_t0[x][w]) + (sr_t0[y_ref][w] - s_t0[y][w]) * (sr_t0[y_ref][w] - s_t0[y][w]))
+                + weight_heading * ((sr_t0[cos_ref][w] - cos_psi[w]) * (sr_t0[cos_ref][w] - cos_psi[w]) + (sr_t0[sin_ref][w] - sin_psi[w]) * (sr_t0[sin_ref][w] - sin_psi[w]))
+                + weight_input * u_t0[F][w] * u_t0[F][w];
+            double ds_ = v_;
+            s_t0[x][w] += dt * dx_;
+            s_t0[y][w] += dt * dy_;
+            s_t0[v][w] += dt * dv_;
+            s_t0[psi][w] += dt * dpsi_;
+            s_t0[s][w] += dt * ds_;
+            s_t0[l][w] += dt * dl_;
+            s_t0[v][w] = (s_t0[v][w] < 0.0) ? 0.0 : s_t0[v][w];
+        }
 
-            t+= dt;
+        // Save the states in the trajectory of the lanes:
+        for (int n = 0; n < nX; n++){
+            for (int w = 0; w < lanes; w++){
+                X_lanes[(nX * j + n) * lanes + w] = s_t0[n][w];
+            }
         }
     }
 }
 
 /** Dyanamic step */
-void DynamicGamePlanner::dynamic_step(double* d_state, const double* state, const double* ref_state, const double* control)
+template <int N_>
+void DynamicGamePlanner<N_>::dynamic_step(double* d_state, const double* state, const double* ref_state, const double* control) const
 {
     /* Derivatives computation:*/
     d_state[x] = state[v] * cos(state[psi] + cg_ratio * control[d]);
     d_state[y] = state[v] * sin(state[psi] + cg_ratio * control[d]);
     d_state[v] = (-1/tau) * state[v] + (k) * control[F];
     d_state[psi] = state[v] * tan(control[d]) * cos(cg_ratio * control[d])/ length;
-    d_state[l] = weight_target_speed * (state[v] - ref_state[v]) * (state[v] - ref_state[v])
-            + weight_center_lane * ((ref_state[x] - state[x]) * (ref_state[x] - state[x]) + (ref_state[y] - state[y]) * (ref_state[y] - state[y]))
-            + weight_heading * ((std::cos(ref_state[psi]) - std::cos(state[psi]))*(std::cos(ref_state[psi]) - std::cos(state[psi]))
-            +        (std::sin(ref_state[psi]) - std::sin(state[psi]))*(std::sin(ref_state[psi]) - std::sin(state[psi])))
+    d_state[l] = weight_target_speed * (state[v] - ref_state[v_ref]) * (state[v] - ref_state[v_ref])
+            + weight_center_lane * ((ref_state[x_ref] - state[x]) * (ref_state[x_ref] - state[x]) + (ref_state[y_ref] - state[y]) * (ref_state[y_ref] - state[y]))
+            + weight_heading * ((ref_state[cos_ref] - std::cos(state[psi]))*(ref_state[cos_ref] - std::cos(state[psi]))
+            +        (ref_state[sin_ref] - std::sin(state[psi]))*(ref_state[sin_ref] - std::sin(state[psi])))
             + weight_input * control[F] * control[F];
     d_state[s] = state[v];
 }
 
 /** SR1 Hessian matrix update*/
-void DynamicGamePlanner::hessian_SR1_update(Eigen::MatrixXd & H_, const Eigen::MatrixXd & s_, const Eigen::MatrixXd & y_, double r_)
+template <int N_>
+void DynamicGamePlanner<N_>::hessian_SR1_update(Eigen::Ref<HessianMatrix> H_, const Eigen::Ref<const InputVector> & s_, const Eigen::Ref<const InputVector> & y_, double r_) const
 {
-    if (abs((s_.transpose() * (y_ - H_ * s_))(0,0)) > 
-                r_ * (s_.transpose() * s_)(0,0) * ((y_ - H_* s_).transpose() * (y_ - H_ * s_))(0,0))
+    const InputVector r = y_ - H_ * s_;
+    const double sr = s_.dot(r);
+    if (std::abs(sr) > r_ * s_.squaredNorm() * r.squaredNorm())
     {
-        H_ = H_ + ((y_ - H_ * s_) * (y_ - H_ * s_).transpose()) / ((y_ - H_ * s_).transpose() * s_)(0,0);
+        H_.noalias() += (r * r.transpose()) / sr;
     }
 }
 
+/** Hessian update of the best response, dense or limited-memory */
+template <int N_>
+void DynamicGamePlanner<N_>::hessian_update(Eigen::Ref<HessianMatrix> H_, const InputVector & s_, const InputVector & y_, double r_) const
+{
+    hessian_SR1_update(H_, s_, y_, r_);
+}
+
+template <int N_>
+void DynamicGamePlanner<N_>::hessian_update(LimitedHessian & H_, const InputVector & s_, const InputVector & y_, double r_) const
+{
+    H_.update(s_, y_, r_);
+}
+
 /** function to increase rho = rho * gamma at each iteration */
-void DynamicGamePlanner::increasing_schedule()
+template <int N_>
+void DynamicGamePlanner<N_>::increasing_schedule(SolverState& state) const
 {
-    rho = gamma * rho;
+    state.rho = gamma * state.rho;
+    state.lagrangian_epoch++;
 }
 
 /** function to save the lagrangian multipliers in the general variable */
-void DynamicGamePlanner::save_lagrangian_multipliers(double* lagrangian_multipliers_)
+template <int N_>
+void DynamicGamePlanner<N_>::save_lagrangian_multipliers(SolverState& state, double* lagrangian_multipliers_) const
 {
-    for (int i = 0; i < nC; i++){
-        lagrangian_multipliers(i,0) = lagrangian_multipliers_[i];
+    bool changed = false;
+    for (int i = 0; i < state.nC; i++){
+        changed = changed || (state.lagrangian_multipliers[i] != lagrangian_multipliers_[i]);
+        state.lagrangian_multipliers[i] = lagrangian_multipliers_[i];
+    }
+    if (changed){
+        state.lagrangian_epoch++;
     }
 }
 
 /* computation of lambda (without update)*/
-void DynamicGamePlanner::compute_lagrangian_multipliers(double* lagrangian_multipliers_, const double* constraints_)
+template <int N_>
+void DynamicGamePlanner<N_>::compute_lagrangian_multipliers(const SolverState& state, double* lagrangian_multipliers_, const double* constraints_) const
 {
     double l;
-    for (int i = 0; i < nC; i++){
-        l = lagrangian_multipliers(i,0) + rho * constraints_[i];
+    for (int i = 0; i < state.nC; i++){
+        l = state.lagrangian_multipliers[i] + state.rho * constraints_[i];
         lagrangian_multipliers_[i] = std::max(l, 0.0);
     }
 }
 
 /** computation of the inequality constraints (target: constraints < 0) */
-void DynamicGamePlanner::compute_constraints(double* constraints, const double* X_, const double* U_)
+template <int N_>
+void DynamicGamePlanner<N_>::compute_constraints(const SolverState& state, double* constraints, const double* X_) const
 {
-    double constraints_i[nC_i];
-    for (int i = 0; i < M; i++){
-        compute_constraints_vehicle_i(constraints_i, X_, U_, i);
-        for (int j = 0; j < nC_i; j++){
-            constraints[nC_i * i + j] = constraints_i[j];
-        }
+    PROFILE_PHASE(state.stats, compute_constraints);
+    double* pair_distances = state.workspace.pair_distances.data();
+    compute_pair_distances(state, pair_distances, X_);
+    for (int i = 0; i < state.M; i++){
+        compute_constraints_vehicle_i(state, &constraints[state.constraint_start[i]], X_, pair_distances, i);
     }
 }
 
-/** computation of the inequality constraints C for vehicle i (target: C < 0) */
-void DynamicGamePlanner::compute_constraints_vehicle_i(double* constraints_i, const double* X_, const double* U_, int i)
+/** computation of the inequality constraints C for vehicle i (target: C < 0): lane constraints, then the collision 
+ * avoidance constraints of the blocks of vehicle i read from the distance tensor of X_ */
+template <int N_>
+void DynamicGamePlanner<N_>::compute_constraints_vehicle_i(const SolverState& state, double* constraints_i, const double* X_, const double* pair_distances, int i) const
 {
-    int ind = 0;
-    int indCu;
-    int indCl;
-    int indU;
-    int indCto;
-    int indClk;
-    int indCuk;
-    int indf;
-    int n1;
-    int n2;
-    double dist2t[N + 1];
-    double rad2[N + 1];
     double latdist2t[N + 1];
     double r_lane_ = r_lane;
+    double r_safe_ = r_safe + collision_margin;
+    const double* dist2;
 
-    // constraints for the inputs 
-    indU = nU * (N + 1) * i;
-    indCu = nU * (N + 1);
-    indCl = indCu + nU * (N + 1);
+    // constraints to remain in the lane
+    compute_squared_lateral_distance_vector(state, latdist2t, X_, i);
     for (int k = 0; k < N + 1; k++){
-        constraints_i[nU * k + d] = 1e3 * (U_[indU + nU * k + d] - uu(nU * k + d,0));
-        constraints_i[nU * k + F] = 1e3 * (U_[indU + nU * k + F] - uu(nU * k + F,0));
-        constraints_i[indCu + nU * k + d] = 1e3 * (ul(nU * k + d,0) - U_[indU + nU * k + d]);
-        constraints_i[indCu + nU * k + F] = 1e3 * (ul(nU * k + F,0) - U_[indU + nU * k + F]);
+        constraints_i[k] = (latdist2t[k] - r_lane_ * r_lane_);
     }
 
-    // collision avoidance constraints  
-    for (int k = 0; k < M; k++){
-        if (k != i){
-            indCto = indCl + (N + 1) * ind;
-            compute_squared_distances_vector(dist2t, X_, i, k);
-            for (int j = 0; j < N + 1; j++){
-                constraints_i[indCto + j] = (r_safe * r_safe - dist2t[j]);
-            }
-            ind++;
+    // collision avoidance constraints of the near pairs, the distances of the pair are stored by the vehicle with the 
+    // lower index:
+    for (int b = state.block_start[i]; b < state.block_start[i + 1]; b++){
+        const CollisionBlock& block = state.blocks[b];
+        dist2 = &pair_distances[(block.k > i) ? state.constraint_start[i] + block.row : block.partner];
+        for (int r = 0; r < std::min(nB, N + 1 - nB * block.w); r++){
+            constraints_i[block.row + r] = (r_safe_ * r_safe_ - dist2[r]);
         }
     }
-    indCto = indCl + (N + 1) * (M - 1);
+}
+
+/** recomputes the constraints of vehicle i at the nodes from j_start onward, directly from X_: only the trajectory 
+ * of vehicle i changed from j_start, the other rows of constraints_i are kept */
+template <int N_>
+void DynamicGamePlanner<N_>::update_constraints_vehicle_i(const SolverState& state, double* constraints_i, const double* X_, int i, int j_start) const
+{
+    int indCc;
+    double latdist2t[N + 1];
+    double r_lane_ = r_lane;
+    double r_safe_ = r_safe + collision_margin;
+    double dist2;
 
     // constraints to remain in the lane
-    compute_squared_lateral_distance_vector(latdist2t, X_, i);
-    for (int k = 0; k < N + 1; k++){
-        constraints_i[indCto + k] = (latdist2t[k] - r_lane_ * r_lane_);
+    compute_squared_lateral_distance_vector(state, latdist2t, X_, i, j_start);
+    for (int k = j_start; k < N + 1; k++){
+        constraints_i[k] = (latdist2t[k] - r_lane_ * r_lane_);
+    }
+
+    // collision avoidance constraints of the near pairs in the windows after j_start
+    for (int b = state.block_start[i]; b < state.block_start[i + 1]; b++){
+        const CollisionBlock& block = state.blocks[b];
+        if (nB * (block.w + 1) <= j_start){
+            continue;
+        }
+        indCc = block.row - nB * block.w;
+        for (int j = std::max(nB * block.w, j_start); j < std::min(nB * (block.w + 1), N + 1); j++){
+            dist2 = (X_[nx * i + nX * j + x] - X_[nx * block.k + nX * j + x]) * (X_[nx * i + nX * j + x] - X_[nx * block.k + nX * j + x])
+                  + (X_[nx * i + nX * j + y] - X_[nx * block.k + nX * j + y]) * (X_[nx * i + nX * j + y] - X_[nx * block.k + nX * j + y]);
+            constraints_i[indCc + j] = (r_safe_ * r_safe_ - dist2);
+        }
     }
-    indf = indCto + (N + 1);
 }
 
-/** computes a vector of the squared distance between the trajectory of vehicle i and j*/
-void DynamicGamePlanner::compute_squared_distances_vector(double* squared_distances, const double* X_, int ego, int j)
+/** distance tensor of the rollout X_: squared distance of each near pair at the nodes of its windows. The distances 
+ * of the pair (i, k) are computed once, in the collision rows of vehicle min(i, k), and read by the constraints of 
+ * both vehicles. The positions are gathered by vehicle and node, consecutive windows of a pair are contiguous in 
+ * the rows and in the nodes, so each run of windows is a single loop over the nodes */
+template <int N_>
+void DynamicGamePlanner<N_>::compute_pair_distances(const SolverState& state, double* pair_distances, const double* X_) const
 {
-    double x_ego;
-    double y_ego;
-    double x_j;
-    double y_j;
-    double distance;
-    for (int k = 0; k < N + 1; k++){
-        x_ego = X_[nx * ego + nX * k + x];
-        y_ego = X_[nx * ego + nX * k + y];
-        x_j = X_[nx * j + nX * k + x];
-        y_j = X_[nx * j + nX * k + y];
-        distance = (x_ego - x_j) * (x_ego - x_j) + (y_ego - y_j) * (y_ego - y_j);
-        squared_distances[k] = distance;
+    double* px = state.workspace.positions.data();
+    double* py = px + (N + 1) * state.M;
+    int end;
+    int nodes;
+    for (int i = 0; i < state.M; i++){
+        for (int j = 0; j < N + 1; j++){
+            px[(N + 1) * i + j] = X_[nx * i + nX * j + x];
+            py[(N + 1) * i + j] = X_[nx * i + nX * j + y];
+        }
+    }
+    for (int i = 0; i < state.M; i++){
+        for (int b = state.block_start[i]; b < state.block_start[i + 1]; b = end){
+            const CollisionBlock& block = state.blocks[b];
+            end = b + 1;
+            if (block.k < i){
+                continue;
+            }
+            while (end < state.block_start[i + 1] && state.blocks[end].k == block.k 
+                   && state.blocks[end].w == state.blocks[end - 1].w + 1){
+                end++;
+            }
+            nodes = std::min(nB * (block.w + end - b), N + 1) - nB * block.w;
+            const double* xi = &px[(N + 1) * i + nB * block.w];
+            const double* yi = &py[(N + 1) * i + nB * block.w];
+            const double* xk = &px[(N + 1) * block.k + nB * block.w];
+            const double* yk = &py[(N + 1) * block.k + nB * block.w];
+            double* dist2 = &pair_distances[state.constraint_start[i] + block.row];
+            for (int r = 0; r < nodes; r++){
+                dist2[r] = (xi[r] - xk[r]) * (xi[r] - xk[r]) + (yi[r] - yk[r]) * (yi[r] - yk[r]);
+            }
+        }
+    }
+}
+
+/** broad phase of the collision avoidance: the positions of each vehicle in a window of nB nodes are bounded by a box, 
+ * two vehicles can collide in the window only if their boxes are closer than r_safe + broad_phase_margin. Only the 
+ * collision constraints of these pairs are stored, the pairs are updated when X changes. With merge the pairs close 
+ * in X are added to the current ones. Without broad phase all the pairs are near */
+template <int N_>
+void DynamicGamePlanner<N_>::update_broad_phase(SolverState& state, const double* X_, bool merge) const
+{
+    const int M = state.M;
+    if (broad_phase == false){
+        state.near_pairs.assign(M * M * nW, 1);
+        update_constraint_blocks(state);
+        return;
+    }
+    const double r = r_safe + collision_margin + broad_phase_margin;
+    std::vector<double>& boxes = state.workspace.boxes;
+    boxes.resize(4 * nW * M);
+
+    // Boxes <x_min, x_max, y_min, y_max> of each vehicle and window:
+    for (int i = 0; i < M; i++){
+        for (int w = 0; w < nW; w++){
+            double* box = &boxes[4 * (nW * i + w)];
+            box[0] = box[2] = 1e300;
+            box[1] = box[3] = -1e300;
+            for (int j = nB * w; j < std::min(nB * (w + 1), N + 1); j++){
+                box[0] = std::min(box[0], X_[nx * i + nX * j + x]);
+                box[1] = std::max(box[1], X_[nx * i + nX * j + x]);
+                box[2] = std::min(box[2], X_[nx * i + nX * j + y]);
+                box[3] = std::max(box[3], X_[nx * i + nX * j + y]);
+            }
+        }
+    }
+
+    // Overlap of the boxes enlarged by r:
+    for (int i = 0; i < M; i++){
+        for (int k = i + 1; k < M; k++){
+            for (int w = 0; w < nW; w++){
+                const double* box_i = &boxes[4 * (nW * i + w)];
+                const double* box_k = &boxes[4 * (nW * k + w)];
+                char near = (box_i[0] - r < box_k[1] && box_k[0] - r < box_i[1] 
+                          && box_i[2] - r < box_k[3] && box_k[2] - r < box_i[3]);
+                if (merge == true){
+                    near = near || state.near_pairs[(M * i + k) * nW + w];
+                }
+                state.near_pairs[(M * i + k) * nW + w] = near;
+                state.near_pairs[(M * k + i) * nW + w] = near;
+            }
+        }
+    }
+    update_constraint_blocks(state);
+}
+
+/** stores a collision block for each near pair and window, after the lane constraints of each vehicle. 
+ * The lagrangian multipliers of the blocks already stored are kept, the ones of new blocks are zero */
+template <int N_>
+void DynamicGamePlanner<N_>::update_constraint_blocks(SolverState& state) const
+{
+    Workspace& ws = state.workspace;
+    const int M = state.M;
+    int row;
+    int b_old;
+
+    // Keep the previous blocks and multipliers:
+    std::swap(ws.blocks, state.blocks);
+    std::swap(ws.block_start, state.block_start);
+    std::swap(ws.constraint_start, state.constraint_start);
+    std::swap(ws.multipliers, state.lagrangian_multipliers);
+
+    // New blocks, sorted by vehicle, other vehicle and window:
+    state.blocks.clear();
+    state.block_start.resize(M + 1);
+    state.constraint_start.resize(M + 1);
+    state.constraint_start[0] = 0;
+    for (int i = 0; i < M; i++){
+        state.block_start[i] = state.blocks.size();
+        row = nF;
+        for (int k = 0; k < M; k++){
+            for (int w = 0; w < nW && k != i; w++){
+                if (state.near_pairs[(M * i + k) * nW + w]){
+                    state.blocks.push_back(CollisionBlock{k, w, row, -1});
+                    row += std::min(nB, N + 1 - nB * w);
+                }
+            }
+        }
+        state.constraint_start[i + 1] = state.constraint_start[i] + row;
+    }
+    state.block_start[M] = state.blocks.size();
+    state.nC = state.constraint_start[M];
+
+    // Rows of the same pair and window in the constraints of the other vehicle, for the distance tensor:
+    for (int i = 0; i < M; i++){
+        for (int b = state.block_start[i]; b < state.block_start[i + 1]; b++){
+            CollisionBlock& block = state.blocks[b];
+            block.partner = state.constraint_start[block.k] 
+                          + collision_row(state.blocks, state.block_start[block.k], state.block_start[block.k + 1], i, nB * block.w);
+        }
+    }
+
+    // The lagrangian changes only if the blocks changed, the multipliers of the blocks kept are the same:
+    bool changed = (state.blocks.size() != ws.blocks.size()) || (state.block_start != ws.block_start);
+    for (size_t b = 0; b < state.blocks.size() && !changed; b++){
+        changed = (state.blocks[b].k != ws.blocks[b].k || state.blocks[b].w != ws.blocks[b].w);
+    }
+    if (changed){
+        state.lagrangian_epoch++;
+    }
+
+    // Multipliers of the lane constraints, and of the blocks in both lists:
+    state.lagrangian_multipliers.assign(state.nC, 0.0);
+    for (int i = 0; i < M; i++){
+        const int start = state.constraint_start[i];
+        const int start_old = ws.constraint_start[i];
+        for (int r = 0; r < nF; r++){
+            state.lagrangian_multipliers[start + r] = ws.multipliers[start_old + r];
+        }
+        b_old = ws.block_start[i];
+        for (int b = state.block_start[i]; b < state.block_start[i + 1]; b++){
+            const CollisionBlock& block = state.blocks[b];
+            while (b_old < ws.block_start[i + 1] && (ws.blocks[b_old].k < block.k 
+                   || (ws.blocks[b_old].k == block.k && ws.blocks[b_old].w < block.w))){
+                b_old++;
+            }
+            if (b_old < ws.block_start[i + 1] && ws.blocks[b_old].k == block.k && ws.blocks[b_old].w == block.w){
+                for (int r = 0; r < std::min(nB, N + 1 - nB * block.w); r++){
+                    state.lagrangian_multipliers[start + block.row + r] = ws.multipliers[start_old + ws.blocks[b_old].row + r];
+                }
+            }
+        }
     }
+
+    // Buffers with one row per constraint:
+    ws.constraints.resize(state.nC);
+    ws.constraints_gradient.resize(state.nC);
+    ws.pair_distances.resize(state.nC);
+    ws.tr_constraints.resize(state.nC);
+    ws.lagrangian_multipliers.resize(state.nC);
 }
 
-/** computes a vector of the squared lateral distance between the i-th trajectory and the allowed center lines at each time step*/
-void DynamicGamePlanner::compute_squared_lateral_distance_vector(double* squared_distances_, const double* X_, int i)
+/** computes a vector of the squared lateral distance between the i-th trajectory and the allowed center lines at each time step 
+ * from j_start onward*/
+template <int N_>
+void DynamicGamePlanner<N_>::compute_squared_lateral_distance_vector(const SolverState& state, double* squared_distances_, const double* X_, int i, int j_start) const
 {
     double s_;
     double x_;
@@ -296,9 +1125,12 @@ void DynamicGamePlanner::compute_squared_lateral_distance_vector(double* squared
     double y_r;
     double x_l;
     double y_l;
-    double psi_c;
-    double psi_l;
-    double psi_r;
+    double cos_c;
+    double sin_c;
+    double cos_l;
+    double sin_l;
+    double cos_r;
+    double sin_r;
     double dist_c;
     double dist_l = 1e3;
     double dist_r = 1e3;
@@ -309,35 +1141,29 @@ void DynamicGamePlanner::compute_squared_lateral_distance_vector(double* squared
     double dist2_l[N + 1];
     double dist2_r[N + 1];
     double dist2_rl_min;
-    for (int j = 0; j < N + 1; j++){
+    for (int j = j_start; j < N + 1; j++){
         s_ = X_[nx * i + nX * j + s];
         x_ = X_[nx * i + nX * j + x];
         y_ = X_[nx * i + nX * j + y];
         dist2_c[j] = 1e3;
         dist2_l[j] = 1e3;
         dist2_r[j] = 1e3;
-        if (s_ < traffic[i].centerlane.s_max){
-            x_c = traffic[i].centerlane.spline_x(s_);
-            y_c = traffic[i].centerlane.spline_y(s_);
-            psi_c = traffic[i].centerlane.compute_heading(s_);
+        if (s_ < state.traffic[i]->centerlane.s_max){
+            state.traffic[i]->centerlane.lookup(s_, x_c, y_c, cos_c, sin_c);
             dist_c = ((x_ - x_c) * (x_ - x_c) + (y_ - y_c) * (y_ - y_c));
-            dist_long_c = ((x_ - x_c) * std::cos(psi_c) + (y_ - y_c) * std::sin(psi_c)) * ((x_ - x_c) * std::cos(psi_c) + (y_ - y_c) * std::sin(psi_c));
+            dist_long_c = ((x_ - x_c) * cos_c + (y_ - y_c) * sin_c) * ((x_ - x_c) * cos_c + (y_ - y_c) * sin_c);
             dist2_c[j] = dist_c - dist_long_c;
         }
-        if (traffic[i].leftlane.present == true && s_ < traffic[i].leftlane.s_max && traffic[i].leftlane.s_max > 10.0){
-            x_l = traffic[i].leftlane.spline_x(s_);
-            y_l = traffic[i].leftlane.spline_y(s_);
-            psi_l = traffic[i].leftlane.compute_heading(s_);
+        if (state.traffic[i]->leftlane.present == true && s_ < state.traffic[i]->leftlane.s_max && state.traffic[i]->leftlane.s_max > 10.0){
+            state.traffic[i]->leftlane.lookup(s_, x_l, y_l, cos_l, sin_l);
             dist_l = ((x_ - x_l) * (x_ - x_l) + (y_ - y_l) * (y_ - y_l));
-            dist_long_l = ((x_ - x_l) * std::cos(psi_l) + (y_ - y_l) * std::sin(psi_l)) * ((x_ - x_l) * std::cos(psi_l) + (y_ - y_l) * std::sin(psi_l));
+            dist_long_l = ((x_ - x_l) * cos_l + (y_ - y_l) * sin_l) * ((x_ - x_l) * cos_l + (y_ - y_l) * sin_l);
             dist2_l[j] = dist_l - dist_long_l;
         }
-        if (traffic[i].rightlane.present == true && s_ < traffic[i].rightlane.s_max && traffic[i].rightlane.s_max > 10.0){
-            x_r = traffic[i].rightlane.spline_x(s_);
-            y_r = traffic[i].rightlane.spline_y(s_);
-            psi_r = traffic[i].rightlane.compute_heading(s_);
+        if (state.traffic[i]->rightlane.present == true && s_ < state.traffic[i]->rightlane.s_max && state.traffic[i]->rightlane.s_max > 10.0){
+            state.traffic[i]->rightlane.lookup(s_, x_r, y_r, cos_r, sin_r);
             dist_r = ((x_ - x_r) * (x_ - x_r) + (y_ - y_r) * (y_ - y_r));
-            dist_long_r = ((x_ - x_r) * std::cos(psi_r) + (y_ - y_r) * std::sin(psi_r)) * ((x_ - x_r) * std::cos(psi_r) + (y_ - y_r) * std::sin(psi_r));
+            dist_long_r = ((x_ - x_r) * cos_r + (y_ - y_r) * sin_r) * ((x_ - x_r) * cos_r + (y_ - y_r) * sin_r);
             dist2_r[j] = dist_r - dist_long_r;
         }
         dist2_rl_min = std::min(dist2_l[j], dist2_r[j]);
@@ -345,8 +1171,76 @@ void DynamicGamePlanner::compute_squared_lateral_distance_vector(double* squared
     }
 }
 
+/** computes the derivatives of the squared lateral distance vector with respect to x, y and s of the i-th trajectory, 
+ * following the lane selected in compute_squared_lateral_distance_vector */
+template <int N_>
+void DynamicGamePlanner<N_>::compute_squared_lateral_distance_gradient(const SolverState& state, double* d_dist2_x, double* d_dist2_y, double* d_dist2_s, const double* X_, int i) const
+{
+    double s_;
+    double x_;
+    double y_;
+    double ex;
+    double ey;
+    double a;
+    double dx;
+    double dy;
+    double ddx;
+    double ddy;
+    double x_lane;
+    double y_lane;
+    double cos_psi;
+    double sin_psi;
+    double dpsi;
+    double dist2[3];
+    bool active[3];
+    const Lane* lanes[3] = {&state.traffic[i]->centerlane, &state.traffic[i]->leftlane, &state.traffic[i]->rightlane};
+    size_t cursor[3][2] = {{0, 0}, {0, 0}, {0, 0}};
+    int sel;
+    for (int j = 0; j < N + 1; j++){
+        s_ = X_[nx * i + nX * j + s];
+        x_ = X_[nx * i + nX * j + x];
+        y_ = X_[nx * i + nX * j + y];
+        d_dist2_x[j] = 0.0;
+        d_dist2_y[j] = 0.0;
+        d_dist2_s[j] = 0.0;
+        dist2[0] = 1e3;
+        dist2[1] = 1e3;
+        dist2[2] = 1e3;
+        for (int n = 0; n < 3; n++){
+            const Lane& lane = *lanes[n];
+            active[n] = (n == 0) ? (s_ < lane.s_max) : (lane.present == true && s_ < lane.s_max && lane.s_max > 10.0);
+            if (active[n]){
+                lane.lookup(s_, x_lane, y_lane, cos_psi, sin_psi);
+                ex = x_ - x_lane;
+                ey = y_ - y_lane;
+                a = ex * cos_psi + ey * sin_psi;
+                dist2[n] = (ex * ex + ey * ey) - a * a;
+            }
+        }
+
+        // same selection as std::min(std::min(dist2_l, dist2_r), dist2_c):
+        sel = (dist2[2] < dist2[1]) ? 2 : 1;
+        if (dist2[0] < dist2[sel]){sel = 0;}
+        if (active[sel] == false){continue;}
+
+        const Lane& lane = *lanes[sel];
+        lane.lookup(s_, x_lane, y_lane, cos_psi, sin_psi);
+        ex = x_ - x_lane;
+        ey = y_ - y_lane;
+        lane.spline_x.eval_cursor(s_, cursor[sel][0], NULL, &dx, &ddx);
+        lane.spline_y.eval_cursor(s_, cursor[sel][1], NULL, &dy, &ddy);
+        dpsi = (dx * ddy - dy * ddx) / (dx * dx + dy * dy);
+        a = ex * cos_psi + ey * sin_psi;
+        d_dist2_x[j] = 2.0 * ex - 2.0 * a * cos_psi;
+        d_dist2_y[j] = 2.0 * ey - 2.0 * a * sin_psi;
+        d_dist2_s[j] = - 2.0 * (ex * dx + ey * dy) 
+                    - 2.0 * a * (- dx * cos_psi - dy * sin_psi + dpsi * (- ex * sin_psi + ey * cos_psi));
+    }
+}
+
 /** compute the cost for vehicle i */
-double DynamicGamePlanner::compute_cost_vehicle_i(const double* X_, const double* U_, int i)
+template <int N_>
+double DynamicGamePlanner<N_>::compute_cost_vehicle_i(const double* X_, const double* U_, int i) const
 {
     double final_lagrangian = X_[nx * i + nX * N + l];
     double cost = 0.5 * final_lagrangian * qf * final_lagrangian;
@@ -354,203 +1248,737 @@ double DynamicGamePlanner::compute_cost_vehicle_i(const double* X_, const double
 }
 
 /** computes of the augmented lagrangian vector  L = <L_1, ..., L_M> L_i = cost_i + lagrangian_multipliers * constraints */
-void DynamicGamePlanner::compute_lagrangian(double* lagrangian, const double* X_, const double* U_)
+template <int N_>
+void DynamicGamePlanner<N_>::compute_lagrangian(const SolverState& state, double* lagrangian, const double* X_, const double* U_) const
 {
+    PROFILE_PHASE(state.stats, compute_lagrangian);
     double lagrangian_i;
     double cost_i;
-    double constraints_i[nC_i];
-    double lagrangian_multipliers_i[nC_i];
-    for (int i = 0; i < M; i++){
+    double* constraints_i = state.workspace.thread_scratch(thread_pool->thread_index()) + state.nU_ + state.nX_;
+    double* pair_distances = state.workspace.pair_distances.data();
+    compute_pair_distances(state, pair_distances, X_);
+    for (int i = 0; i < state.M; i++){
         cost_i = compute_cost_vehicle_i( X_, U_, i);
-        compute_constraints_vehicle_i(constraints_i, X_, U_, i);
-        lagrangian_i = compute_lagrangian_vehicle_i( cost_i, constraints_i, i);
+        compute_constraints_vehicle_i(state, constraints_i, X_, pair_distances, i);
+        lagrangian_i = compute_lagrangian_vehicle_i(state,  cost_i, constraints_i, i);
         lagrangian[i] = lagrangian_i;
     }
 }
 
 /** computation of the augmented lagrangian for vehicle i: lagrangian_i = cost_i + lagrangian_multipliers_i * constraints_i */
-double DynamicGamePlanner::compute_lagrangian_vehicle_i(double cost_i, const double* constraints_i, int i)
+template <int N_>
+double DynamicGamePlanner<N_>::compute_lagrangian_vehicle_i(const SolverState& state, double cost_i, const double* constraints_i, int i) const
 {
     double lagrangian_i = cost_i;
     double constraints;
-    for (int k = 0; k < nC_i; k++){
+    const double* lagrangian_multipliers_i = &state.lagrangian_multipliers[state.constraint_start[i]];
+    for (int k = 0; k < state.constraint_start[i + 1] - state.constraint_start[i]; k++){
         constraints = std::max(0.0, constraints_i[k]);
-        lagrangian_i += 0.5 * rho * constraints * constraints + lagrangian_multipliers(i * nC_i + k,0) * constraints_i[k];
+        lagrangian_i += 0.5 * state.rho * constraints * constraints + lagrangian_multipliers_i[k] * constraints_i[k];
     }
     return lagrangian_i;
 }
 
-/** computation of the gradient of lagrangian_i with respect to U_i for each i with parallelization on cpu*/
-void DynamicGamePlanner::compute_gradient(double* gradient, const double* U_)
+/** computation of the gradient of lagrangian_i with respect to U_i for each i */
+template <int N_>
+void DynamicGamePlanner<N_>::compute_gradient(const SolverState& state, double* gradient, const double* U_) const
+{
+    Workspace& ws = state.workspace;
+    double* X_ = ws.X_gradient.data();
+    double* lagrangian = ws.lagrangian_gradient.data();
+
+    // Baseline trajectory and lagrangian, the lagrangian is only used by the finite differences:
+    integrate(state, X_, U_);
+    if (gradient_method == finite_differences){
+        compute_lagrangian(state, lagrangian, X_, U_);
+    }
+    compute_gradient(state, gradient, X_, U_, lagrangian);
+}
+
+/** computation of the gradient of lagrangian_i with respect to U_i for each i, from the state trajectory X_ and the 
+ * lagrangian at U_ */
+template <int N_>
+void DynamicGamePlanner<N_>::compute_gradient(const SolverState& state, double* gradient, const double* X_, const double* U_, const double* lagrangian) const
 {
-    const int num_threads = std::thread::hardware_concurrency();
-    std::mutex mutex;
-    std::vector<std::thread> threads(num_threads);
+    PROFILE_PHASE(state.stats, compute_gradient);
+    switch (gradient_method){
+        case finite_differences:
+            compute_gradient_finite_differences(state, gradient, X_, U_, lagrangian);
+            break;
+        case adjoint:
+            compute_gradient_adjoint(state, gradient, X_, U_);
+            break;
+    }
+}
 
-    // Definition of the work for each thread:
-    auto computeGradient = [&](int start, int end) {
-        double dU[nU_];
-        double dX[nX_];
-        double X_[nX_];
-        double lagrangian[M];
+/** computation of the gradient with finite differences with parallelization on cpu, around the baseline trajectory X_ 
+ * and lagrangian shared by all the workers. The baseline constraints are computed once, a perturbation at node j only 
+ * recomputes the constraints of the perturbed vehicle from node j onward */
+template <int N_>
+void DynamicGamePlanner<N_>::compute_gradient_finite_differences(const SolverState& state, double* gradient, const double* X_, const double* U_, const double* lagrangian) const
+{
+    Workspace& ws = state.workspace;
+    std::vector<int>& bounds = ws.bounds;
+    const double* constraints = ws.constraints_gradient.data();
+    compute_constraints(state, ws.constraints_gradient.data(), X_);
+
+    // Definition of the work for each chunk, with the batched rollout kernel (each lane is one perturbation, 
+    // up to lanes consecutive perturbations of the same vehicle are integrated together):
+    auto computeGradientLanes = [&](int chunk) {
+        double* dU = ws.thread_scratch(thread_pool->thread_index());
+        double* dX = dU + state.nU_;
+        double* constraints_i = dX + state.nX_;
+        double* X_lanes = constraints_i + 2 * state.nC_i;
         double lagrangian_i;
         double cost_i;
-        double constraints_i[nC_i];
-        double lagrangian_multipliers_i[nC_i];
+        int perturbed[lanes];
         int index;
-        for (int i = 0; i < nU_; i++){
+        int node;
+        int count;
+        for (int i = 0; i < state.nU_; i++){
             dU[i] = U_[i];
         }
-        integrate(X_, U_);
-        compute_lagrangian(lagrangian, X_, U_);
-        for (int i = start; i < end; i++) {
+        for (int i = 0; i < state.nX_; i++){
+            dX[i] = X_[i];
+        }
+        for (int i = bounds[chunk]; i < bounds[chunk + 1]; i += count) {
             index = i / nu;
-            dU[i] = U_[i] + eps;
-            integrate(dX, dU);
-            compute_constraints_vehicle_i(constraints_i, dX, dU, index);
-            cost_i = compute_cost_vehicle_i( dX, dU, index);
-            lagrangian_i = compute_lagrangian_vehicle_i( cost_i, constraints_i, index);
-            {
-                std::lock_guard<std::mutex> lock(mutex);
-                gradient[i] = (lagrangian_i - lagrangian[index]) / eps;
+            node = (i % nu) / nU;
+            count = std::min(std::min(lanes, bounds[chunk + 1] - i), nu * (index + 1) - i);
+            for (int w = 0; w < lanes; w++){
+                perturbed[w] = (w < count) ? i + w : -1;
+            }
+            integrate_vehicle_i_lanes(state, X_lanes, X_, U_, perturbed, index, node);
+
+            // Lagrangian of vehicle index for each lane:
+            for (int w = 0; w < count; w++){
+                for (int j = node; j < N + 1; j++){
+                    for (int n = 0; n < nX; n++){
+                        dX[nx * index + nX * j + n] = X_lanes[(nX * j + n) * lanes + w];
+                    }
+                }
+                dU[i + w] = U_[i + w] + eps;
+                for (int k = state.constraint_start[index]; k < state.constraint_start[index + 1]; k++){
+                    constraints_i[k - state.constraint_start[index]] = constraints[k];
+                }
+                update_constraints_vehicle_i(state, constraints_i, dX, index, node);
+                cost_i = compute_cost_vehicle_i( dX, dU, index);
+                lagrangian_i = compute_lagrangian_vehicle_i(state,  cost_i, constraints_i, index);
+                gradient[i + w] = (lagrangian_i - lagrangian[index]) / eps;
+                dU[i + w] = U_[i + w];
+            }
+
+            // Restore the baseline trajectory:
+            for (int j = nx * index + nX * node; j < nx * (index + 1); j++){
+                dX[j] = X_[j];
             }
-            dU[i] = U_[i];
         }
     };
 
-    // Parallelize:
-    int work_per_thread = nU_ / num_threads;
-    int start_index = 0;
-    int end_index = 0;
-    for (int i = 0; i < num_threads; ++i) {
-        start_index = i * work_per_thread;
-        end_index = (i == num_threads - 1) ? nU_ : start_index + work_per_thread;
-        threads[i] = std::thread(computeGradient, start_index, end_index);
-    }
-    for (auto& thread : threads) {
-        thread.join();
-    }
-}
+    // Definition of the work for each chunk:
+    auto computeGradient = [&](int chunk) {
+        double* dU = ws.thread_scratch(thread_pool->thread_index());
+        double* dX = dU + state.nU_;
+        double* constraints_i = dX + state.nX_;
+        double lagrangian_i;
+        double cost_i;
+        int index;
+        int node;
+        for (int i = 0; i < state.nU_; i++){
+            dU[i] = U_[i];
+        }
+        for (int i = 0; i < state.nX_; i++){
+            dX[i] = X_[i];
+        }
+        for (int i = bounds[chunk]; i < bounds[chunk + 1]; i++) {
+            index = i / nu;
+            node = (i % nu) / nU;
 
-/** it solves the quadratic problem (GT * s + 0.5 * sT * H * s) with solution included in the trust region ||s|| < Delta */
-void DynamicGamePlanner::quadratic_problem_solver(Eigen::MatrixXd & s_, const Eigen::MatrixXd & G_, const Eigen::MatrixXd & H_, double Delta)
-{
-    Eigen::MatrixXd ps(nG,1);
-    double tau;
-    double tau_c;
-    double normG;
-    double GTHG;
-    GTHG = (G_.transpose() * H_ * G_)(0,0);
-    normG = sqrt((G_.transpose() * G_)(0,0));
-    ps = - Delta * (G_ /(normG));
-    if ( GTHG <= 0.0){
-        tau = 1.0;
+            // Only the trajectory of vehicle index from the perturbed node onward changes:
+            dU[i] = U_[i] + eps;
+            integrate_vehicle_i(state, dX, dU, index, node);
+            for (int k = state.constraint_start[index]; k < state.constraint_start[index + 1]; k++){
+                constraints_i[k - state.constraint_start[index]] = constraints[k];
+            }
+            update_constraints_vehicle_i(state, constraints_i, dX, index, node);
+            cost_i = compute_cost_vehicle_i( dX, dU, index);
+            lagrangian_i = compute_lagrangian_vehicle_i(state,  cost_i, constraints_i, index);
+            gradient[i] = (lagrangian_i - lagrangian[index]) / eps;
+            dU[i] = U_[i];
+
+            // Restore the baseline trajectory:
+            for (int j = nx * index + nX * node; j < nx * (index + 1); j++){
+                dX[j] = X_[j];
+            }
+        }
+    };
+
+    // Parallelize:
+    split_gradient_work(state, bounds);
+    PROFILE(state.stats.rollouts += state.nU_);
+    if (simd_rollout == true){
+        thread_pool->parallel_for(bounds.size() - 1, computeGradientLanes);
     }else{
-        tau_c = (normG * normG * normG)/(Delta * GTHG);
-        tau = std::min(tau_c, 1.0);
+        thread_pool->parallel_for(bounds.size() - 1, computeGradient);
     }
-    s_ = tau * ps;
 }
 
-/** prints if some constraints are violated */
-void DynamicGamePlanner::constraints_diagnostic(const double* constraints, bool print = false)
+/** splits the perturbations in contiguous chunks of similar cost. A perturbation at node j re-integrates N + 1 - j steps 
+ * and evaluates the constraints of one vehicle, each chunk also copies the baseline X and U. The chunks are at least 
+ * min_chunk_cost steps, and at most 4 per thread to balance the load */
+template <int N_>
+void DynamicGamePlanner<N_>::split_gradient_work(const SolverState& state, std::vector<int>& bounds) const
 {
-    bool flag0 = false;
-    bool flag1 = false;
-    bool flag2 = false;
-    bool flag3 = false;
-    for (int i = 0; i < M; i++){
-        flag0 = false;
-        flag1 = false;
-        flag2 = false;
-        flag3 = false;
-        for (int j = 0; j < nC_i; j++){
-            if (constraints[nC_i * i +j] > 0){
-                if (j < (2 * nU * (N + 1))) {
-                    std::cerr<<"vehicle "<<i<<" violates input constraints: "<<constraints[nC_i * i + j]<<"\n";
-                    flag0 = true;
-                }
-                if (j < (2 * nU * (N + 1) + (N + 1) * (M - 1)) && j > (2 * nU * (N + 1))){
-                    std::cerr<<"vehicle "<<i<<" violates collision avoidance constraints: "<<constraints[nC_i * i + j]<<"\n";
-                    flag1 = true;
-                }
-                if (j > (2 * nU * (N + 1) + (N + 1) * (M - 1)) && j < (2 * nU * (N + 1) + (N + 1) * (M - 1) + (N + 1))){
-                    std::cerr<<"vehicle "<<i<<" violates lane constraints: "<<constraints[nC_i * i + j]<<"\n";
-                    flag2 = true;
-                }
-            }
+    const double cost_constraints = (N + 1) * (1.0 + 0.05 * (state.M - 1));
+    const double cost_copy = 0.02 * (state.nX_ + state.nU_);
+    double* cost = state.workspace.cost.data();
+    double total_cost = 0.0;
+    double chunk_cost;
+    double acc;
+    int num_chunks;
+
+    for (int i = 0; i < state.nU_; i++){
+        cost[i] = (N + 1 - (i % nu) / nU) + cost_constraints;
+        total_cost += cost[i];
+    }
+    num_chunks = std::min((int) (total_cost / std::max(min_chunk_cost, cost_copy)), 4 * thread_pool->size());
+    num_chunks = std::max(1, std::min(num_chunks, state.nU_));
+    if (thread_pool->size() == 1){
+        num_chunks = 1;
+    }
+    chunk_cost = total_cost / num_chunks;
+
+    bounds.clear();
+    bounds.push_back(0);
+    acc = 0.0;
+    for (int i = 0; i < state.nU_; i++){
+        acc += cost[i];
+        if (acc >= chunk_cost * bounds.size() && (int) bounds.size() < num_chunks){
+            bounds.push_back(i + 1);
         }
-        if (print == true){
-            std::cerr<<"vehicle "<<i<<"\n";
-            std::cerr<<"input constraint: \n";
-            for (int j = 0; j < 2 * nU * (N + 1); j++){
-                std::cerr<<constraints[nC_i * i +j]<<"\t";
-            }
-            std::cerr<<"\ncollision avoidance constraint: \n";
-            for (int j = 2 * nU * (N + 1); j < (2 * nU * (N + 1) + (N + 1) * (M - 1)); j++){
-                std::cerr<<constraints[nC_i * i +j]<<"\t";
+    }
+    bounds.push_back(state.nU_);
+}
+
+/** computation of the gradient with the adjoint method: one backward sweep for each vehicle along the rollout X_, 
+ * the constraints of all the vehicles are computed once before the sweeps */
+template <int N_>
+void DynamicGamePlanner<N_>::compute_gradient_adjoint(const SolverState& state, double* gradient, const double* X_, const double* U_) const
+{
+    compute_constraints(state, state.workspace.constraints_gradient.data(), X_);
+    const double* constraints = state.workspace.constraints_gradient.data();
+    thread_pool->parallel_for(state.M, [&](int i) {
+        compute_gradient_vehicle_i_adjoint(state, &gradient[nu * i], X_, U_, &constraints[state.constraint_start[i]], i);
+    });
+}
+
+/** computation of the gradient of lagrangian_i with respect to U_i alone, the other vehicles are frozen. X_, 
+ * constraints_i and lagrangian_i are the ones of vehicle i at U_ */
+template <int N_>
+void DynamicGamePlanner<N_>::compute_gradient_vehicle_i(const SolverState& state, double* gradient_i, double* X_, double* U_, const double* constraints_i, double lagrangian_i, int i) const
+{
+    PROFILE_AGENT_PHASE(state.stats, compute_gradient, i);
+    switch (gradient_method){
+        case finite_differences:
+            compute_gradient_vehicle_i_finite_differences(state, gradient_i, X_, U_, constraints_i, lagrangian_i, i);
+            break;
+        case adjoint:
+            compute_gradient_vehicle_i_adjoint(state, gradient_i, X_, U_, constraints_i, i);
+            break;
+    }
+}
+
+/** finite differences of lagrangian_i on the inputs of vehicle i: a perturbation at node j re-integrates vehicle i and 
+ * recomputes its constraints from node j onward. X_ and U_ are restored after each perturbation */
+template <int N_>
+void DynamicGamePlanner<N_>::compute_gradient_vehicle_i_finite_differences(const SolverState& state, double* gradient_i, double* X_, double* U_, const double* constraints_i, double lagrangian_i, int i) const
+{
+    double* d_constraints_i = state.workspace.thread_scratch(thread_pool->thread_index()) + state.nU_ + state.nX_ + state.nC_i;
+    double* X_i = d_constraints_i + state.nC_i;
+    double u;
+    double cost_i;
+    int node;
+    for (int j = 0; j < nx; j++){
+        X_i[j] = X_[nx * i + j];
+    }
+    for (int k = 0; k < nu; k++){
+        node = k / nU;
+        u = U_[nu * i + k];
+        U_[nu * i + k] = u + eps;
+        integrate_vehicle_i(state, X_, U_, i, node);
+        for (int r = 0; r < state.constraint_start[i + 1] - state.constraint_start[i]; r++){
+            d_constraints_i[r] = constraints_i[r];
+        }
+        update_constraints_vehicle_i(state, d_constraints_i, X_, i, node);
+        cost_i = compute_cost_vehicle_i(X_, U_, i);
+        gradient_i[k] = (compute_lagrangian_vehicle_i(state, cost_i, d_constraints_i, i) - lagrangian_i) / eps;
+
+        // Restore the inputs and the trajectory:
+        U_[nu * i + k] = u;
+        for (int j = nX * node; j < nx; j++){
+            X_[nx * i + j] = X_i[j];
+        }
+    }
+}
+
+/** backpropagates lagrangian_i through compute_lagrangian_vehicle_i, compute_constraints_vehicle_i, 
+ * the Euler update and the dynamic step of vehicle i to get the gradient with respect to U_i. constraints_i are the 
+ * constraints of vehicle i in X_ */
+template <int N_>
+void DynamicGamePlanner<N_>::compute_gradient_vehicle_i_adjoint(const SolverState& state, double* gradient_i, const double* X_, const double* U_, const double* constraints_i, int i) const
+{
+    int tu;
+    int td;
+    int indCc;
+    double s_ref;
+    double dx_ref;
+    double dy_ref;
+    double ddx_ref;
+    double ddy_ref;
+    size_t cursor_x = 0;                    /** segments of the center lane splines, s increases along the trajectory */
+    size_t cursor_y = 0;
+    double weight;
+    double* weights_i = state.workspace.thread_scratch(thread_pool->thread_index()) + state.nU_ + state.nX_ + state.nC_i;
+    double d_dist2_x[N + 1];
+    double d_dist2_y[N + 1];
+    double d_dist2_s[N + 1];
+    double d_coll_x[N + 1];                 /** derivatives of the collision penalties with respect to x and y */
+    double d_coll_y[N + 1];
+    double s_t0[N + 1][nX];                 /** state before the j-th step */
+    double sr_t0[N + 1][nR];                /** reference point on the center lane */
+    double dsr_t0[N + 1][3];                /** derivatives of the reference x, y, psi with respect to s */
+    bool saturated[N + 1];                  /** speed saturated at zero after the j-th step */
+    double ds_t0[nX];
+    double u_t0[nU];
+    double adj[nX];                         /** adjoint: derivative of lagrangian_i with respect to the state X_i[j] */
+    double adj_[nX];
+
+    // Derivative of lagrangian_i with respect to each constraint:
+    for (int k = 0; k < state.constraint_start[i + 1] - state.constraint_start[i]; k++){
+        weights_i[k] = state.rho * std::max(0.0, constraints_i[k]) + state.lagrangian_multipliers[state.constraint_start[i] + k];
+    }
+    compute_squared_lateral_distance_gradient(state, d_dist2_x, d_dist2_y, d_dist2_s, X_, i);
+
+    // Derivatives of the collision avoidance terms, accumulated on the blocks of vehicle i:
+    for (int j = 0; j < N + 1; j++){
+        d_coll_x[j] = 0.0;
+        d_coll_y[j] = 0.0;
+    }
+    for (int b = state.block_start[i]; b < state.block_start[i + 1]; b++){
+        const CollisionBlock& block = state.blocks[b];
+        indCc = block.row - nB * block.w;
+        for (int j = nB * block.w; j < std::min(nB * (block.w + 1), N + 1); j++){
+            weight = weights_i[indCc + j];
+            d_coll_x[j] += - 2.0 * weight * (X_[nx * i + nX * j + x] - X_[nx * block.k + nX * j + x]);
+            d_coll_y[j] += - 2.0 * weight * (X_[nx * i + nX * j + y] - X_[nx * block.k + nX * j + y]);
+        }
+    }
+
+    // Forward sweep to store the linearization points of each step:
+    for (int j = 0; j < N + 1; j++){
+        if (j == 0){
+            s_t0[j][x] = state.traffic[i]->x;
+            s_t0[j][y] = state.traffic[i]->y;
+            s_t0[j][v] = state.traffic[i]->v;
+            s_t0[j][psi] = state.traffic[i]->psi;
+            s_t0[j][s] = 0.0;
+            s_t0[j][l] = 0.0;
+        }else{
+            for (int n = 0; n < nX; n++){
+                s_t0[j][n] = X_[nx * i + nX * (j - 1) + n];
             }
-            std::cerr<<"\nlane constraint: \n";
-            for (int j = (2 * nU * (N + 1) + (N + 1) * (M - 1)); j < (2 * nU * (N + 1) + (N + 1) * (M - 1) + (N + 1)); j++){
-                std::cerr<<constraints[nC_i * i +j]<<"\t";
+        }
+        s_ref = s_t0[j][s];
+        state.traffic[i]->centerlane.lookup(s_ref, sr_t0[j][x_ref], sr_t0[j][y_ref], sr_t0[j][cos_ref], sr_t0[j][sin_ref]);
+        sr_t0[j][v_ref] = state.traffic[i]->v +  j * (state.traffic[i]->v_target - state.traffic[i]->v) / N;
+        state.traffic[i]->centerlane.spline_x.eval_cursor(s_ref, cursor_x, NULL, &dx_ref, &ddx_ref);
+        state.traffic[i]->centerlane.spline_y.eval_cursor(s_ref, cursor_y, NULL, &dy_ref, &ddy_ref);
+        dsr_t0[j][x] = dx_ref;
+        dsr_t0[j][y] = dy_ref;
+        dsr_t0[j][2] = (dx_ref * ddy_ref - dy_ref * ddx_ref) / (dx_ref * dx_ref + dy_ref * dy_ref);
+        tu = nu * i + nU * j;
+        u_t0[d] = U_[tu + d];
+        u_t0[F] = U_[tu + F];
+        dynamic_step(ds_t0, s_t0[j], sr_t0[j], u_t0);
+        saturated[j] = (s_t0[j][v] + dt * ds_t0[v] < 0.0);
+    }
+
+    // Backward sweep:
+    for (int n = 0; n < nX; n++){
+        adj[n] = 0.0;
+    }
+    for (int j = N; j >= 0; j--){
+        tu = nu * i + nU * j;
+        td = nx * i + nX * j;
+
+        // Cost on the final lagrangian state:
+        if (j == N){
+            adj[l] += qf * X_[td + l];
+        }
+
+        // Collision avoidance constraints at node j:
+        adj[x] += d_coll_x[j];
+        adj[y] += d_coll_y[j];
+
+        // Lane constraints at node j:
+        weight = weights_i[j];
+        adj[x] += weight * d_dist2_x[j];
+        adj[y] += weight * d_dist2_y[j];
+        adj[s] += weight * d_dist2_s[j];
+
+        // Saturation of the speed:
+        if (saturated[j]){
+            adj[v] = 0.0;
+        }
+
+        // Partial derivatives of the Euler step X[j] = X[j - 1] + dt * f(X[j - 1], U[j]):
+        const double* st = s_t0[j];
+        const double* sr = sr_t0[j];
+        const double* dsr = dsr_t0[j];
+        double u_d = U_[tu + d];
+        double u_F = U_[tu + F];
+        double cos_psi = std::cos(st[psi] + cg_ratio * u_d);
+        double sin_psi = std::sin(st[psi] + cg_ratio * u_d);
+        double sin_err = sr[sin_ref] * std::cos(st[psi]) - sr[cos_ref] * std::sin(st[psi]);
+        double cos_d = std::cos(u_d);
+
+        // Gradient with respect to the input at node j:
+        gradient_i[nU * j + d] = dt * (adj[x] * (- cg_ratio * st[v] * sin_psi)
+                            + adj[y] * (cg_ratio * st[v] * cos_psi)
+                            + adj[psi] * st[v] * (std::cos(cg_ratio * u_d) / (cos_d * cos_d) 
+                                - cg_ratio * std::tan(u_d) * std::sin(cg_ratio * u_d)) / length);
+        gradient_i[nU * j + F] = dt * (adj[v] * k + adj[l] * 2.0 * weight_input * u_F);
+
+        // Adjoint with respect to the state before the step:
+        adj_[x] = adj[x] + dt * adj[l] * (- 2.0 * weight_center_lane * (sr[x_ref] - st[x]));
+        adj_[y] = adj[y] + dt * adj[l] * (- 2.0 * weight_center_lane * (sr[y_ref] - st[y]));
+        adj_[v] = adj[v] + dt * (adj[x] * cos_psi + adj[y] * sin_psi - adj[v] / tau 
+                            + adj[psi] * std::tan(u_d) * std::cos(cg_ratio * u_d) / length
+                            + adj[l] * 2.0 * weight_target_speed * (st[v] - sr[v_ref]) + adj[s]);
+        adj_[psi] = adj[psi] + dt * (adj[x] * (- st[v] * sin_psi) + adj[y] * (st[v] * cos_psi)
+                            + adj[l] * (- 2.0 * weight_heading * sin_err));
+        adj_[s] = adj[s] + dt * adj[l] * (2.0 * weight_center_lane * ((sr[x_ref] - st[x]) * dsr[x] + (sr[y_ref] - st[y]) * dsr[y])
+                            + 2.0 * weight_heading * sin_err * dsr[2]);
+        adj_[l] = adj[l];
+        for (int n = 0; n < nX; n++){
+            adj[n] = adj_[n];
+        }
+    }
+}
+
+/** it solves the quadratic problem (GT * s + 0.5 * sT * H * s) with solution included in the trust region ||s|| < Delta
+ * and in the box s_low <= s <= s_up of the input bounds, with the subproblem_method. Returns its iterations */
+template <int N_>
+int DynamicGamePlanner<N_>::quadratic_problem_solver(Eigen::Ref<InputVector> s_, const Eigen::Ref<const InputVector> & G_, const Eigen::Ref<const HessianMatrix> & H_, double Delta, const Eigen::Ref<const InputVector> & s_low, const Eigen::Ref<const InputVector> & s_up) const
+{
+    switch (subproblem_method){
+        case dogleg:
+            return quadratic_problem_dogleg(s_, G_, H_, Delta, s_low, s_up);
+        case steihaug_cg:
+            return quadratic_problem_steihaug_cg(s_, G_, H_, Delta, s_low, s_up);
+        case cauchy_point:
+        default:
+            return quadratic_problem_cauchy_point(s_, G_, H_, Delta, s_low, s_up);
+    }
+}
+
+/** same as above with a limited-memory Hessian, the engines only use products with H */
+template <int N_>
+int DynamicGamePlanner<N_>::quadratic_problem_solver(Eigen::Ref<InputVector> s_, const Eigen::Ref<const InputVector> & G_, const LimitedHessian & H_, double Delta, const Eigen::Ref<const InputVector> & s_low, const Eigen::Ref<const InputVector> & s_up) const
+{
+    switch (subproblem_method){
+        case dogleg:
+            return quadratic_problem_dogleg(s_, G_, H_, Delta, s_low, s_up);
+        case steihaug_cg:
+            return quadratic_problem_steihaug_cg(s_, G_, H_, Delta, s_low, s_up);
+        case cauchy_point:
+        default:
+            return quadratic_problem_cauchy_point(s_, G_, H_, Delta, s_low, s_up);
+    }
+}
+
+/** generalized Cauchy point: the first minimum of the model along the projection of the steepest descent path - G * t 
+ * on the box. The path is a sequence of segments, at the end of each segment one more input reaches its bound and is 
+ * fixed. Without active bounds it is the Cauchy point. Returns the number of segments */
+template <int N_>
+template <class Hessian>
+int DynamicGamePlanner<N_>::quadratic_problem_cauchy_point(Eigen::Ref<InputVector> s_, const Eigen::Ref<const InputVector> & G_, const Hessian & H_, double Delta, const Eigen::Ref<const InputVector> & s_low, const Eigen::Ref<const InputVector> & s_up) const
+{
+    InputVector p;                          /** direction of the current segment */
+    InputVector Hp;
+    InputVector t_bound;                    /** value of t where each input reaches its bound */
+    double t = 0.0;
+    double t_next;
+    double slope;
+    double curvature;
+    double step;
+    double step_tr;
+    double a;
+    double b;
+    double c;
+    int iterations = 0;
+
+    // Inputs at a bound with the steepest descent pointing outside the box do not move:
+    s_.setZero();
+    p = - G_;
+    for (int n = 0; n < nu; n++){
+        if ((p(n) < 0.0 && s_low(n) >= 0.0) || (p(n) > 0.0 && s_up(n) <= 0.0)){
+            p(n) = 0.0;
+        }
+        t_bound(n) = (p(n) < 0.0) ? s_low(n) / p(n) : (p(n) > 0.0) ? s_up(n) / p(n) : INFINITY;
+    }
+
+    while (p.squaredNorm() > 0.0){
+        iterations++;
+
+        // Model along the segment s_ + step * p: slope + curvature * step
+        t_next = t_bound.minCoeff();
+        Hp = H_ * p;
+        slope = G_.dot(p) + s_.dot(Hp);
+        curvature = p.dot(Hp);
+        if (slope >= 0.0){
+            break;
+        }
+
+        // Step where the segment leaves the trust region: ||s_ + step * p|| = Delta
+        a = p.squaredNorm();
+        b = s_.dot(p);
+        c = s_.squaredNorm() - Delta * Delta;
+        step_tr = (- b + std::sqrt(std::max(b * b - a * c, 0.0))) / a;
+        step = std::min(t_next - t, step_tr);
+
+        // Minimum of the model inside the segment:
+        if (curvature > 0.0 && - slope / curvature < step){
+            s_ += (- slope / curvature) * p;
+            break;
+        }
+        s_ += step * p;
+        if (step_tr <= t_next - t){
+            break;
+        }
+
+        // Fix the inputs reaching their bound at the end of the segment:
+        t = t_next;
+        for (int n = 0; n < nu; n++){
+            if (t_bound(n) <= t){
+                s_(n) = (p(n) < 0.0) ? s_low(n) : s_up(n);
+                p(n) = 0.0;
+                t_bound(n) = INFINITY;
             }
-            std::cerr<<"\n";
         }
     }
+    return iterations;
 }
 
-void DynamicGamePlanner::print_trajectories(const double* X, const double* U)
+/** dogleg step: path from the origin to the minimizer along the steepest descent, then to the Newton point. The inputs 
+ * blocked at a bound are fixed as in the Cauchy point, the path stops at the trust region or at the box. The Newton point 
+ * needs H positive definite on the free inputs, otherwise, or if the generalized Cauchy point has a lower model, that 
+ * point is taken. Returns the segments of the Cauchy point plus one for the Newton point */
+template <int N_>
+template <class Hessian>
+int DynamicGamePlanner<N_>::quadratic_problem_dogleg(Eigen::Ref<InputVector> s_, const Eigen::Ref<const InputVector> & G_, const Hessian & H_, double Delta, const Eigen::Ref<const InputVector> & s_low, const Eigen::Ref<const InputVector> & s_up) const
 {
-    // Define column width
-    const int col_width = 12;  // Adjust this value as needed
+    InputVector free_;                      /** 1 for the inputs not blocked at a bound, 0 otherwise */
+    InputVector G_free;
+    InputVector p_u;                        /** minimizer along the steepest descent */
+    InputVector p_n;                        /** Newton point */
+    InputVector s_d;
+    double GTHG;
+    double step;
+    int iterations;
 
-    for (int i = 0; i < M; i++){
-        std::cerr << "Vehicle: (" << traffic[i].x << ", " << traffic[i].y << ") \t" << traffic[i].v << "\n";
-
-        // Print table header with aligned columns
-        std::cerr << std::left  // Align text to the left
-                  << std::setw(col_width) << "X"
-                  << std::setw(col_width) << "Y"
-                  << std::setw(col_width) << "V"
-                  << std::setw(col_width) << "PSI"
-                  << std::setw(col_width) << "S"
-                  << std::setw(col_width) << "L"
-                  << std::setw(col_width) << "F"
-                  << std::setw(col_width) << "d"
-                  << "\n";
-
-        // Print separator line
-        std::cerr << std::string(col_width * 8, '-') << "\n";
-
-        // Print trajectory values
-        for (int j = 0; j < N + 1; j++){
-            std::cerr << std::fixed << std::left
-                      << std::setw(col_width) << X[nX * (N + 1) * i + nX * j + x]
-                      << std::setw(col_width) << X[nX * (N + 1) * i + nX * j + y]
-                      << std::setw(col_width) << X[nX * (N + 1) * i + nX * j + v]
-                      << std::setw(col_width) << X[nX * (N + 1) * i + nX * j + psi]
-                      << std::setw(col_width) << X[nX * (N + 1) * i + nX * j + s]
-                      << std::setw(col_width) << X[nX * (N + 1) * i + nX * j + l]
-                      << std::setw(col_width) << U[nU * (N + 1) * i + nU * j + F]
-                      << std::setw(col_width) << U[nU * (N + 1) * i + nU * j + d]
-                      << "\n";
+    // Reference step, also used if the dogleg path is not defined:
+    iterations = quadratic_problem_cauchy_point(s_, G_, H_, Delta, s_low, s_up) + 1;
+
+    for (int n = 0; n < nu; n++){
+        free_(n) = ((G_(n) > 0.0 && s_low(n) >= 0.0) || (G_(n) < 0.0 && s_up(n) <= 0.0)) ? 0.0 : 1.0;
+    }
+    G_free = G_.cwiseProduct(free_);
+    GTHG = G_free.dot(H_ * G_free);
+    if (G_free.squaredNorm() == 0.0 || GTHG <= 0.0){
+        return iterations;
+    }
+    if (!newton_point(p_n, G_free, H_, free_)){
+        return iterations;
+    }
+    p_u = - (G_free.squaredNorm() / GTHG) * G_free;
+
+    // First leg, up to p_u:
+    s_d.setZero();
+    step = std::min(1.0, max_step(s_d, p_u, Delta, s_low, s_up));
+    s_d = step * p_u;
+
+    // Second leg, from p_u to p_n:
+    if (step == 1.0){
+        p_n -= p_u;
+        s_d += std::min(1.0, max_step(s_d, p_n, Delta, s_low, s_up)) * p_n;
+    }
+
+    if (G_.dot(s_d) + 0.5 * s_d.dot(H_ * s_d) < G_.dot(s_) + 0.5 * s_.dot(H_ * s_)){
+        s_ = s_d;
+    }
+    return iterations;
+}
+
+/** truncated conjugate gradient (Steihaug-Toint) from the generalized Cauchy point, on the inputs that are not on a 
+ * bound there. It stops at negative curvature or when a step leaves the trust region or the box, on their boundary, 
+ * or when the residual is reduced enough. The model is never above the one of the Cauchy point. Returns the segments 
+ * of the Cauchy point plus the conjugate gradient iterations */
+template <int N_>
+template <class Hessian>
+int DynamicGamePlanner<N_>::quadratic_problem_steihaug_cg(Eigen::Ref<InputVector> s_, const Eigen::Ref<const InputVector> & G_, const Hessian & H_, double Delta, const Eigen::Ref<const InputVector> & s_low, const Eigen::Ref<const InputVector> & s_up) const
+{
+    InputVector free_;                      /** 1 for the inputs not on a bound at the Cauchy point, 0 otherwise */
+    InputVector r;                          /** residual: gradient of the model on the free inputs */
+    InputVector p;
+    InputVector Hp;
+    double rr;
+    double rr_new;
+    double pHp;
+    double alpha;
+    double step;
+    double tolerance;
+    int iterations;
+
+    iterations = quadratic_problem_cauchy_point(s_, G_, H_, Delta, s_low, s_up);
+
+    for (int n = 0; n < nu; n++){
+        free_(n) = (s_(n) > s_low(n) && s_(n) < s_up(n)) ? 1.0 : 0.0;
+    }
+    r = (G_ + H_ * s_).cwiseProduct(free_);
+    p = - r;
+    rr = r.squaredNorm();
+    tolerance = std::min(0.5, std::pow(rr, 0.25)) * std::sqrt(rr);
+
+    for (int it = 0; it < nu && std::sqrt(rr) > tolerance; it++){
+        iterations++;
+        Hp = (H_ * p).cwiseProduct(free_);
+        pHp = p.dot(Hp);
+        step = max_step(s_, p, Delta, s_low, s_up);
+
+        // Negative curvature, or minimum along p outside the feasible region: stop on its boundary
+        if (pHp <= 0.0 || rr / pHp >= step){
+            s_ += step * p;
+            break;
         }
-        std::cerr << "\n";
+        alpha = rr / pHp;
+        s_ += alpha * p;
+        r += alpha * Hp;
+        rr_new = r.squaredNorm();
+        p = - r + (rr_new / rr) * p;
+        rr = rr_new;
     }
+    return iterations;
 }
 
-/** sets the prediction to the traffic structure*/
-TrafficParticipants DynamicGamePlanner::set_prediction(const double* X_, const double* U_)
+/** Newton point of the dogleg with the dense Hessian: Cholesky factorization of H on the free inputs, with the identity 
+ * on the fixed ones */
+template <int N_>
+bool DynamicGamePlanner<N_>::newton_point(Eigen::Ref<InputVector> p_n, const Eigen::Ref<const InputVector> & G_free, const Eigen::Ref<const HessianMatrix> & H_, const Eigen::Ref<const InputVector> & free_) const
 {
-    TrafficParticipants traffic_ = traffic;
-    for (int i = 0; i < M; i++){
-        Trajectory trajectory;
-        Control control;
+    HessianMatrix H_free = H_;
+    for (int n = 0; n < nu; n++){
+        if (free_(n) == 0.0){
+            H_free.row(n).setZero();
+            H_free.col(n).setZero();
+            H_free(n, n) = 1.0;
+        }
+    }
+    Eigen::LLT<HessianMatrix> llt(H_free);
+    if (llt.info() != Eigen::Success){
+        return false;
+    }
+    p_n = - llt.solve(G_free);
+    return true;
+}
+
+/** Newton point of the dogleg with the limited-memory Hessian: conjugate gradient on the free inputs with products by H, 
+ * fails on a direction of non-positive curvature */
+template <int N_>
+bool DynamicGamePlanner<N_>::newton_point(Eigen::Ref<InputVector> p_n, const Eigen::Ref<const InputVector> & G_free, const LimitedHessian & H_, const Eigen::Ref<const InputVector> & free_) const
+{
+    InputVector r = G_free;
+    InputVector p = - r;
+    InputVector Hp;
+    double rr = r.squaredNorm();
+    double rr_new;
+    double pHp;
+    double alpha;
+    const double tolerance = 1e-10 * std::sqrt(rr);
+
+    p_n.setZero();
+    for (int it = 0; it < nu && std::sqrt(rr) > tolerance; it++){
+        Hp = (H_ * p).cwiseProduct(free_);
+        pHp = p.dot(Hp);
+        if (pHp <= 0.0){
+            return false;
+        }
+        alpha = rr / pHp;
+        p_n += alpha * p;
+        r += alpha * Hp;
+        rr_new = r.squaredNorm();
+        p = - r + (rr_new / rr) * p;
+        rr = rr_new;
+    }
+    return true;
+}
+
+/** largest t >= 0 such that s_ + t * p is in the trust region ||s|| <= Delta and in the box s_low <= s <= s_up */
+template <int N_>
+double DynamicGamePlanner<N_>::max_step(const Eigen::Ref<const InputVector> & s_, const Eigen::Ref<const InputVector> & p, double Delta, const Eigen::Ref<const InputVector> & s_low, const Eigen::Ref<const InputVector> & s_up) const
+{
+    double a = p.squaredNorm();
+    double b = s_.dot(p);
+    double c = s_.squaredNorm() - Delta * Delta;
+    double step = (a > 0.0) ? (- b + std::sqrt(std::max(b * b - a * c, 0.0))) / a : INFINITY;
+    for (int n = 0; n < nu; n++){
+        if (p(n) < 0.0){
+            step = std::min(step, (s_low(n) - s_(n)) / p(n));
+        }
+        if (p(n) > 0.0){
+            step = std::min(step, (s_up(n) - s_(n)) / p(n));
+        }
+    }
+    return std::max(step, 0.0);
+}
+
+/** violated constraints of each vehicle, the lane constraints then the collision blocks */
+template <int N_>
+void DynamicGamePlanner<N_>::compute_violations(const SolverState& state, const double* constraints, std::vector<ConstraintViolation>& violations) const
+{
+    violations.clear();
+    for (int i = 0; i < state.M; i++){
+        const double* constraints_i = &constraints[state.constraint_start[i]];
+        for (int j = 0; j < nF; j++){
+            if (constraints_i[j] > 0){
+                violations.push_back(ConstraintViolation{i, -1, j, constraints_i[j]});
+            }
+        }
+        for (int b = state.block_start[i]; b < state.block_start[i + 1]; b++){
+            const CollisionBlock& block = state.blocks[b];
+            for (int r = 0; r < std::min(nB, N + 1 - nB * block.w); r++){
+                if (constraints_i[block.row + r] > 0){
+                    violations.push_back(ConstraintViolation{i, block.k, nB * block.w + r, constraints_i[block.row + r]});
+                }
+            }
+        }
+    }
+}
+
+template <int N_>
+void DynamicGamePlanner<N_>::set_prediction(const SolverState& state, const double* X_, const double* U_, TrafficParticipants& traffic_state) const
+{
+    for (int i = 0; i < state.M; i++){
+        Trajectory& trajectory = traffic_state[i].predicted_trajectory;
+        Control& control = traffic_state[i].predicted_control;
         double time = 0.0;
 
+        // The predictions of the previous run are overwritten, their storage is reused:
+        trajectory.resize(N + 1);
+        control.resize(N + 1);
         for (int j = 0; j < N + 1; j++){
-            TrajectoryPoint point;
-            Input input;
+            TrajectoryPoint& point = trajectory[j];
+            Input& input = control[j];
             input.a = (-1/tau) * X_[ nx * i + nX * j + v] + (k) * U_[nu * i + nU * j + F];
             input.delta = U_[nu * i + nU * j + d];
             point.x = X_[ nx * i + nX * j + x];
@@ -561,18 +1989,14 @@ TrafficParticipants DynamicGamePlanner::set_prediction(const double* X_, const d
             point.beta = 0.5 * input.delta;
             point.t_start = time;
             point.t_end = time + dt;
-            trajectory.push_back(point);
-            control.push_back(input);
             time += dt;
         }
-        traffic_[i].predicted_trajectory = trajectory;
-        traffic_[i].predicted_control = control;
     }
-    return traffic_;
 }
 
 /** computes the heading on the spline x(s) and y(s) at parameter s*/
-double DynamicGamePlanner::compute_heading( const tk::spline & spline_x, const tk::spline & spline_y, double s)
+template <int N_>
+double DynamicGamePlanner<N_>::compute_heading( const tk::spline & spline_x, const tk::spline & spline_y, double s) const
 {
     double psi;
     double dx = spline_x.deriv(1, s);
@@ -582,106 +2006,367 @@ double DynamicGamePlanner::compute_heading( const tk::spline & spline_x, const t
     return psi;
 }
 
-/** computes the norm of the gradient */
-double DynamicGamePlanner::gradient_norm(const double* gradient)
+/** computes the norm of the gradient projected on the input bounds: the components of the inputs at a bound that
+ * push outside the box are not counted */
+template <int N_>
+double DynamicGamePlanner<N_>::gradient_norm(const SolverState& state, const double* gradient, const double* U_) const
 {
     double norm = 0.0;
-    for (int j = 0; j < nG; j++){
+    for (int j = 0; j < state.nG; j++){
+        if ((gradient[j] > 0.0 && U_[j] <= state.ul(j % nu, 0)) || (gradient[j] < 0.0 && U_[j] >= state.uu(j % nu, 0))){
+            continue;
+        }
         norm += gradient[j] * gradient[j];
     }
     return norm;
 }
 
-/** Trust-Region solver of the dynamic game*/
-void DynamicGamePlanner::trust_region_solver(double* U_)
+/** empties the evaluation cache, the entries of a previous solve are not valid for the new initial states */
+template <int N_>
+void DynamicGamePlanner<N_>::reset_evaluation_cache(const SolverState& state) const
+{
+    Workspace& ws = state.workspace;
+    for (int e = 0; e < cache_entries; e++){
+        ws.cache_last_use[e] = -1;
+        ws.cache_epoch_lagrangian[e] = -1;
+        ws.cache_epoch_gradient[e] = -1;
+    }
+    ws.cache_clock = 0;
+}
+
+/** entry of the evaluation cache with the inputs U_ and their state trajectory. If U_ is not in the cache, the least 
+ * recently used entry is replaced: the trajectory of each vehicle only depends on its own inputs, it is copied from 
+ * an entry with the same inputs of the vehicle or integrated */
+template <int N_>
+int DynamicGamePlanner<N_>::cache_entry(SolverState& state, const double* U_) const
+{
+    Workspace& ws = state.workspace;
+    int entry = 0;
+    int source;
+
+    // Entry with the same inputs:
+    for (int e = 0; e < cache_entries && evaluation_cache; e++){
+        if (ws.cache_last_use[e] >= 0 && std::memcmp(&ws.cache_U[state.nU_ * e], U_, sizeof(double) * state.nU_) == 0){
+            ws.cache_last_use[e] = ++ws.cache_clock;
+            state.cache_hits++;
+            return e;
+        }
+    }
+
+    // Least recently used entry, it is excluded from the search of the trajectories:
+    for (int e = 1; e < cache_entries; e++){
+        if (ws.cache_last_use[e] < ws.cache_last_use[entry]){
+            entry = e;
+        }
+    }
+    double* U_entry = &ws.cache_U[state.nU_ * entry];
+    double* X_entry = &ws.cache_X[state.nX_ * entry];
+    ws.cache_last_use[entry] = -1;
+    for (int j = 0; j < state.nU_; j++){
+        U_entry[j] = U_[j];
+    }
+
+    // Trajectory of each vehicle:
+    PROFILE_PHASE(state.stats, integrate);
+    for (int i = 0; i < state.M; i++){
+        source = -1;
+        for (int e = 0; e < cache_entries && evaluation_cache && source < 0; e++){
+            if (ws.cache_last_use[e] >= 0 && std::memcmp(&ws.cache_U[state.nU_ * e + nu * i], &U_[nu * i], sizeof(double) * nu) == 0){
+                source = e;
+            }
+        }
+        if (source >= 0){
+            for (int j = nx * i; j < nx * (i + 1); j++){
+                X_entry[j] = ws.cache_X[state.nX_ * source + j];
+            }
+        }else{
+            integrate_vehicle_i(state, X_entry, U_entry, i, 0);
+            PROFILE(state.stats.rollouts++);
+        }
+    }
+    ws.cache_last_use[entry] = ++ws.cache_clock;
+    ws.cache_epoch_lagrangian[entry] = -1;
+    ws.cache_epoch_gradient[entry] = -1;
+    return entry;
+}
+
+/** integrates the input U to get the state X, through the evaluation cache */
+template <int N_>
+void DynamicGamePlanner<N_>::cached_integrate(SolverState& state, double* X_, const double* U_) const
+{
+    const int e = cache_entry(state, U_);
+    const double* X_entry = &state.workspace.cache_X[state.nX_ * e];
+    for (int j = 0; j < state.nX_; j++){
+        X_[j] = X_entry[j];
+    }
+}
+
+/** computes the augmented lagrangian vector at U, through the evaluation cache. The lagrangian of an entry is valid 
+ * while the lagrangian epoch does not change */
+template <int N_>
+void DynamicGamePlanner<N_>::cached_lagrangian(SolverState& state, double* lagrangian, const double* U_) const
+{
+    Workspace& ws = state.workspace;
+    const int e = cache_entry(state, U_);
+    double* lagrangian_entry = &ws.cache_lagrangian[state.M * e];
+    if (evaluation_cache && ws.cache_epoch_lagrangian[e] == state.lagrangian_epoch){
+        state.cache_hits++;
+    }else{
+        compute_lagrangian(state, lagrangian_entry, &ws.cache_X[state.nX_ * e], U_);
+        ws.cache_epoch_lagrangian[e] = state.lagrangian_epoch;
+    }
+    for (int i = 0; i < state.M; i++){
+        lagrangian[i] = lagrangian_entry[i];
+    }
+}
+
+/** computes the gradient at U, through the evaluation cache. The finite differences start from the trajectory and the 
+ * lagrangian of the entry, the lagrangian is kept for the comparison of the trust region */
+template <int N_>
+void DynamicGamePlanner<N_>::cached_gradient(SolverState& state, double* gradient, const double* U_) const
+{
+    Workspace& ws = state.workspace;
+    const int e = cache_entry(state, U_);
+    double* gradient_entry = &ws.cache_gradient[state.nG * e];
+    double* lagrangian_entry = &ws.cache_lagrangian[state.M * e];
+    if (evaluation_cache && ws.cache_epoch_gradient[e] == state.lagrangian_epoch){
+        state.cache_hits++;
+    }else{
+        if (gradient_method == finite_differences && !(evaluation_cache && ws.cache_epoch_lagrangian[e] == state.lagrangian_epoch)){
+            compute_lagrangian(state, lagrangian_entry, &ws.cache_X[state.nX_ * e], U_);
+            ws.cache_epoch_lagrangian[e] = state.lagrangian_epoch;
+        }
+        compute_gradient(state, gradient_entry, &ws.cache_X[state.nX_ * e], U_, lagrangian_entry);
+        ws.cache_epoch_gradient[e] = state.lagrangian_epoch;
+        state.gradient_evaluations++;
+    }
+    for (int j = 0; j < state.nG; j++){
+        gradient[j] = gradient_entry[j];
+    }
+}
+
+/** time left to the solver before the deadline of the run: the budget counts from the start of run(), the steps of 
+ * run() after the solver are estimated by their duration in the previous run */
+template <int N_>
+double DynamicGamePlanner<N_>::remaining_time(const SolverState& state) const
+{
+    if (state.time_budget <= 0.0){
+        return std::numeric_limits<double>::infinity();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - state.start_time;
+    return state.time_budget - elapsed.count() - state.output_time;
+}
+
+/** solver of the dynamic game selected by solver_method */
+template <int N_>
+void DynamicGamePlanner<N_>::solve_game(SolverState& state, double* U_) const
+{
+    switch (solver_method){
+        case trust_region:
+            trust_region_solver(state, U_);
+            break;
+        case best_response_jacobi:
+        case best_response_gauss_seidel:
+            best_response_solver(state, U_);
+            break;
+    }
+}
+
+/** Trust-Region solver of the dynamic game, the steps of each agent are projected on the bounds of the inputs */
+template <int N_>
+void DynamicGamePlanner<N_>::trust_region_solver(SolverState& state, double* U_) const
 {
     bool convergence = false;
 
     // Parameters:
     double eta = 1e-4;
     double r_ = 1e-8;
-    double threshold_gradient_norm = M * 1e-2;
+    double threshold_gradient_norm = state.M * 1e-2;
+    double threshold_constraints = 1e-2;
     int iter = 1;
-    int iter_lim = 20;
+    int iter_lim = max_iterations;
+    int refine_lim = coarse_level ? refinement_iterations : max_iterations;     /** limit of a feasible refined solution */
 
     // Variables definition:
-    double gradient[nG];
-    double dU[nU_]; 
-    double dU_[nU_]; 
-    double dX[nX_]; 
-    double dX_[nX_];
-    double d_gradient[nG];
-    double d_lagrangian[M];
-    double lagrangian[M];
-    double constraints[nC];
-    double lagrangian_multipliers[nC];
-
-    double actual_reduction[M];
-    double predicted_reduction[M];
-    double delta[M];
-    std::vector<Eigen::MatrixXd> H_(M);
-    std::vector<Eigen::MatrixXd> g_(M);
-    std::vector<Eigen::MatrixXd> p_(M);
-    std::vector<Eigen::MatrixXd> s_(M);
-    std::vector<Eigen::MatrixXd> y_(M);
-
-    // Variables initialization:
-    integrate(dX, U_);
-    for (int i = 0; i < nU_; i++){
+    Workspace& ws = state.workspace;
+    double* gradient = ws.gradient.data();
+    double* dU = ws.dU.data(); 
+    double* dU_ = ws.dU_.data(); 
+    double* dX = ws.dX.data(); 
+    double* dX_ = ws.dX_.data();
+    double* d_gradient = ws.d_gradient.data();
+    double* d_lagrangian = ws.d_lagrangian.data();
+    double* lagrangian = ws.lagrangian.data();
+
+    double* actual_reduction = ws.actual_reduction.data();
+    double* predicted_reduction = ws.predicted_reduction.data();
+    double* delta = ws.delta.data();
+
+    // Per-agent Hessian, gradient and step, with sizes known at compile time. The Hessian is dense or limited-memory in 
+    // a slice of hessian_size doubles:
+    const bool dense = (hessian_method == dense_sr1);
+    const int memory = std::min(std::max(memory_length, 1), (int) LimitedHessian::max_memory);
+    const int hessian_size = dense ? nu * nu : LimitedHessian::size(memory);
+    const typename LimitedHessian::UPDATES update = (hessian_method == limited_bfgs) ? LimitedHessian::BFGS : LimitedHessian::SR1;
+    ws.H_.resize(hessian_size * state.M);
+    auto H_ = [&](int i) { return Eigen::Map<HessianMatrix>(&ws.H_[hessian_size * i]); };
+    auto B_ = [&](int i) { return LimitedHessian(&ws.H_[hessian_size * i], memory, update); };
+    auto s_ = [&](int i) { return Eigen::Map<InputVector>(&ws.s_[nu * i]); };
+    auto g_ = [&](int i) { return Eigen::Map<const InputVector>(&gradient[nu * i]); };
+    auto d_g_ = [&](int i) { return Eigen::Map<const InputVector>(&d_gradient[nu * i]); };
+    auto u_ = [&](int i) { return Eigen::Map<const InputVector>(&dU_[nu * i]); };
+    int* subproblem_iterations = ws.subproblem_iterations.data();
+
+    // The agents only write their own slices, their steps can be computed in parallel:
+    auto for_each_agent = [&](const auto& task) {
+        if (state.M >= min_parallel_agents){
+            thread_pool->parallel_for(state.M, task);
+        }else{
+            for (int i = 0; i < state.M; i++){
+                task(i);
+            }
+        }
+    };
+
+    // The projected gradient does not see the constraints, the solution must also be feasible:
+    auto max_constraint = [&](const double* constraints) {
+        double violation = 0.0;
+        for (int j = 0; j < state.nC; j++){
+            violation = std::max(violation, constraints[j]);
+        }
+        return violation;
+    };
+    double norm;
+    double violation;
+
+    // Deadline of the run: a phase starts only if its estimated duration, the longest one so far (the gradient also 
+    // from the previous runs), fits in the time left. The best iterate is the feasible one with the lowest gradient 
+    // norm, else the least infeasible:
+    typedef std::chrono::steady_clock clock;
+    clock::time_point phase_start;
+    double gradient_time = state.gradient_time;
+    double iteration_time = 0.0;
+    double best_norm = std::numeric_limits<double>::infinity();
+    double best_violation = std::numeric_limits<double>::infinity();
+    bool deadline = false;
+    auto save_best = [&]() {
+        bool better = (violation <= threshold_constraints) ? (best_violation > threshold_constraints || norm < best_norm) 
+                                                           : (violation < best_violation);
+        if (better && state.time_budget > 0.0){
+            best_norm = norm;
+            best_violation = violation;
+            for (int i = 0; i < state.nU_; i++){
+                ws.U_best[i] = dU_[i];
+            }
+        }
+    };
+
+    // Variables initialization, the inputs start within their bounds:
+    for (int i = 0; i < state.nU_; i++){
+        U_[i] = std::min(std::max(U_[i], state.ul(i % nu, 0)), state.uu(i % nu, 0));
+    }
+    state.gradient_evaluations = 0;
+    state.agent_gradient_evaluations = 0;
+    state.subproblem_iterations = 0;
+    state.cache_hits = 0;
+    reset_evaluation_cache(state);
+    cached_integrate(state, dX, U_);
+    update_broad_phase(state, dX);
+    for (int i = 0; i < state.nU_; i++){
         dU[i] = U_[i];
         dU_[i] = U_[i];
     }
-    for (int i = 0; i < nX_; i++){
+    for (int i = 0; i < state.nX_; i++){
         dX_[i] = dX[i];
     }
-    for (int i = 0; i < M; i++){
-        H_[i].resize(nu, nu);
-        g_[i].resize(nu, 1);
-        p_[i].resize(nu, 1);
-        s_[i].resize(nu, 1);
-        y_[i].resize(nu, 1);
+    for (int i = 0; i < state.M; i++){
         delta[i] = 1.0;
-        H_[i] = Eigen::MatrixXd::Identity(nu, nu);
+        if (dense){
+            H_(i).setIdentity();
+        }else{
+            B_(i).reset();
+        }
     }
-    compute_gradient(gradient, dU_);
+    compute_constraints(state, ws.tr_constraints.data(), dX);
+    violation = max_constraint(ws.tr_constraints.data());
+    norm = std::numeric_limits<double>::infinity();
 
-    // Check for convergence:
-    if (gradient_norm(gradient) < threshold_gradient_norm){
-        convergence = true;
+    // Check for convergence, without time for one gradient the initial guess is returned:
+    if (remaining_time(state) < gradient_time){
+        deadline = true;
+    }else{
+        phase_start = clock::now();
+        cached_gradient(state, gradient, dU_);
+        gradient_time = std::max(gradient_time, std::chrono::duration<double>(clock::now() - phase_start).count());
+        norm = gradient_norm(state, gradient, dU_);
+        if (norm < threshold_gradient_norm && violation <= threshold_constraints){
+            convergence = true;
+        }
     }
+    save_best();
 
     // Iteration loop:
-    while (convergence == false && iter < iter_lim ){
+    while (convergence == false && deadline == false && iter < iter_lim && (iter < refine_lim || violation > threshold_constraints)){
 
-        // Compute the grandient and the lagrangian
-        integrate(dX_, dU_);
-        compute_gradient(gradient, dU_);
-        compute_lagrangian(lagrangian, dX_, dU_);
-
-        // Solves the quadratic subproblem and compute the possible step dU:
-        for (int i = 0; i < M; i++){
-            for (int j = 0; j < N + 1; j++){
-                g_[i](j * nU + d,0) = gradient[nu * i + j * nU + d];
-                g_[i](j * nU + F,0) = gradient[nu * i + j * nU + F];
+        // An iteration takes two gradients, the first one is cached in the first iteration:
+        if (remaining_time(state) < std::max(iteration_time, 2.0 * gradient_time)){
+            deadline = true;
+            break;
+        }
+        clock::time_point iteration_start = clock::now();
+
+        // Compute the grandient (dX_ is the state of dU_, the gradient of the first iteration is cached):
+        phase_start = clock::now();
+        cached_gradient(state, gradient, dU_);
+        gradient_time = std::max(gradient_time, std::chrono::duration<double>(clock::now() - phase_start).count());
+
+        // Solves the quadratic subproblem within the input bounds and compute the possible step dU (clamped, the 
+        // inputs on a bound are exactly on it):
+        for_each_agent([&](int i) {
+            InputVector s_low = state.ul.col(0) - u_(i);
+            InputVector s_up = state.uu.col(0) - u_(i);
+            {
+                PROFILE_AGENT_PHASE(state.stats, quadratic_problem_solver, i);
+                if (dense){
+                    subproblem_iterations[i] = quadratic_problem_solver(s_(i), g_(i), H_(i), delta[i], s_low, s_up);
+                }else{
+                    subproblem_iterations[i] = quadratic_problem_solver(s_(i), g_(i), B_(i), delta[i], s_low, s_up);
+                }
             }
-            quadratic_problem_solver(s_[i], g_[i], H_[i], delta[i]);
-            for (int j = 0; j < N + 1; j++){
-                dU[nu * i + j * nU + d] = dU_[nu * i + j * nU + d] + s_[i](j * nU + d,0);
-                dU[nu * i + j * nU + F] = dU_[nu * i + j * nU + F] + s_[i](j * nU + F,0);
+            for (int j = 0; j < nu; j++){
+                dU[nu * i + j] = std::min(std::max(dU_[nu * i + j] + s_(i)(j), state.ul(j, 0)), state.uu(j, 0));
             }
+        });
+        for (int i = 0; i < state.M; i++){
+            state.subproblem_iterations += subproblem_iterations[i];
+        }
+
+        // The candidate dU is discarded if the rest of the iteration does not fit in the time left:
+        if (remaining_time(state) < std::max(gradient_time, iteration_time - std::chrono::duration<double>(clock::now() - iteration_start).count())){
+            deadline = true;
+            break;
         }
 
-        // Compute the new grandient and the new lagrangian with the possible step dU:
-        integrate(dX, dU);
-        compute_gradient(d_gradient, dU);
-        compute_lagrangian(d_lagrangian, dX, dU);
+        // Collision pairs of the current and of the possible solution, the lagrangians are compared on the same constraints:
+        cached_integrate(state, dX, dU);
+        update_broad_phase(state, dX_);
+        update_broad_phase(state, dX, true);
+        cached_lagrangian(state, lagrangian, dU_);
+
+        // Compute the new grandient and the new lagrangian with the possible step dU (the lagrangian is the baseline 
+        // of the gradient):
+        phase_start = clock::now();
+        cached_gradient(state, d_gradient, dU);
+        gradient_time = std::max(gradient_time, std::chrono::duration<double>(clock::now() - phase_start).count());
+        cached_lagrangian(state, d_lagrangian, dU);
 
         // Check for each agent if to accept the step or not:
-        for (int i = 0; i < M; i++){
+        for_each_agent([&](int i) {
             
             // Compute the actual reduction and of the predicted reduction:
             actual_reduction[i] = lagrangian[i] - d_lagrangian[i];
-            predicted_reduction[i] = - (g_[i].transpose() *  s_[i] + 0.5 * s_[i].transpose() * H_[i] * s_[i])(0,0);
+            InputVector Hs = dense ? InputVector(H_(i) * s_(i)) : B_(i) * s_(i);
+            predicted_reduction[i] = - (g_(i).dot(s_(i)) + 0.5 * s_(i).dot(Hs));
 
             // In case of very low or negative actual reduction, reject the step:
             if ( actual_reduction[i] / predicted_reduction[i] < eta){ 
@@ -689,11 +2374,14 @@ void DynamicGamePlanner::trust_region_solver(double* U_)
                     dU[nu * i + j * nU + d] = dU_[nu * i + j * nU + d];
                     dU[nu * i + j * nU + F] = dU_[nu * i + j * nU + F];
                 }
+                PROFILE(state.stats.rejected_steps[i]++);
+            }else{
+                PROFILE(state.stats.accepted_steps[i]++);
             }
 
             // In case of great reduction, and solution close to the trust region, increase the trust region:
             if ( actual_reduction[i] / predicted_reduction[i] > 0.75){ 
-                if (std::sqrt((s_[i].transpose() * s_[i])(0,0)) > 0.8 * delta[i]){
+                if (std::sqrt(s_(i).squaredNorm()) > 0.8 * delta[i]){
                     delta[i] = 2.0 * delta[i];
                 }
             }
@@ -704,63 +2392,392 @@ void DynamicGamePlanner::trust_region_solver(double* U_)
             }
 
             // Compute the difference of the gradients, then the Hessian matrix update:
-            for (int j = 0; j < N + 1; j++){
-                y_[i](j * nU + d,0) = d_gradient[nu * i + j * nU + d] - gradient[nu * i + j * nU + d];
-                y_[i](j * nU + F,0) = d_gradient[nu * i + j * nU + F] - gradient[nu * i + j * nU + F];
+            {
+                PROFILE_AGENT_PHASE(state.stats, hessian_update, i);
+                if (dense){
+                    hessian_SR1_update(H_(i), s_(i), d_g_(i) - g_(i), r_);
+                }else{
+                    B_(i).update(s_(i), d_g_(i) - g_(i), r_);
+                }
             }
-            hessian_SR1_update(H_[i], s_[i], y_[i], r_);
 
             // Save the solution for the next iteration:
             for (int j = 0; j < N + 1; j++){
                 dU_[nu * i + j * nU + d] = dU[nu * i + j * nU + d];
                 dU_[nu * i + j * nU + F] = dU[nu * i + j * nU + F];
             }
-        }
-         // Check for convergence:
-        if (gradient_norm(gradient) < threshold_gradient_norm){
-            convergence = true;
-        }
+        });
 
-        // Compute the new state: 
-        integrate(dX_, dU_);
+        // Compute the new state, the trajectories of the agents are the ones of dU or of the previous dU_: 
+        cached_integrate(state, dX_, dU_);
+        update_broad_phase(state, dX_);
 
-        // Compute the constraints with the new solution:
-        compute_constraints(constraints, dX_, dU_);
+        // Compute the constraints with the new solution (the buffers are sized by the broad phase):
+        double* constraints = ws.tr_constraints.data();
+        double* lagrangian_multipliers_ = ws.lagrangian_multipliers.data();
+        compute_constraints(state, constraints, dX_);
+
+        // Check for convergence:
+        norm = gradient_norm(state, gradient, dU_);
+        violation = max_constraint(constraints);
+        if (norm < threshold_gradient_norm && violation <= threshold_constraints){
+            convergence = true;
+        }
+        save_best();
 
         // Compute and save in the general variable the lagrangian multipliers with the new solution:
-        compute_lagrangian_multipliers(lagrangian_multipliers, constraints);
-        save_lagrangian_multipliers(lagrangian_multipliers);
+        compute_lagrangian_multipliers(state, lagrangian_multipliers_, constraints);
+        save_lagrangian_multipliers(state, lagrangian_multipliers_);
 
         // Increase the weight of the constraints in the lagrangian multipliers:
-        increasing_schedule();
+        increasing_schedule(state);
         iter++;
+        iteration_time = std::max(iteration_time, std::chrono::duration<double>(clock::now() - iteration_start).count());
     }
 
-    std::cerr<<"number of iterations: "<<iter<<"\n";
+    state.iterations = iter;
+    PROFILE(state.stats.rho = state.rho);
+    state.gradient_time = gradient_time;
+
+    // At the deadline the best iterate is returned:
+    state.status = convergence ? converged : (deadline ? deadline_reached : iteration_limit);
+    if (deadline){
+        norm = best_norm;
+        violation = best_violation;
+        for (int i = 0; i < state.nU_; i++){
+            dU_[i] = ws.U_best[i];
+        }
+    }
+    state.achieved_gradient_norm = norm;
+    state.constraint_violation = violation;
 
-    //Correct the final solution:
-    correctionU(dU_);
+    // Input of the last node:
+    correctionU(state, dU_);
 
     // Save the solution:
-    for(int k = 0; k < nU_; k++){
+    for(int k = 0; k < state.nU_; k++){
         U_[k] = dU_[k];
     }
 }
 
-void DynamicGamePlanner::correctionU(double* U_)
+/** Iterated best response solver of the dynamic game. In each sweep every agent improves its own inputs against the 
+ * frozen trajectories of the others, with best_response_iterations steps of the trust region on lagrangian_i. The 
+ * Jacobi sweep freezes the solution of the previous sweep and computes the agents in parallel, the Gauss-Seidel sweep 
+ * updates the agents in order and each one sees the new trajectories of the previous ones. The collision pairs, the 
+ * lagrangian multipliers and rho are updated after each sweep as in the trust region solver. The equilibrium residual 
+ * is the projected norm of the joint gradient at the start of each sweep, it is also the gradient of the first step 
+ * of the Jacobi sweep */
+template <int N_>
+void DynamicGamePlanner<N_>::best_response_solver(SolverState& state, double* U_) const
 {
-    for (int i = 0; i < M; i++){
-        for (int j = 0; j < N + 1; j++){
-            if (j == N){
-                U_[nU * (N + 1) * i + nU * j + d] = U_[nU * (N + 1) * i + nU * (j - 1) + d];
-                U_[nU * (N + 1) * i + nU * j + F] = U_[nU * (N + 1) * i + nU * (j - 1) + F];
+    bool convergence = false;
+
+    // Parameters:
+    double threshold_gradient_norm = state.M * 1e-2;
+    double threshold_constraints = 1e-2;
+    int iter = 1;
+    int iter_lim = max_iterations;
+    int refine_lim = coarse_level ? refinement_iterations : max_iterations;     /** limit of a feasible refined solution */
+
+    // Variables definition, dU_ is the solution of the previous sweep and dU the one of the current sweep:
+    Workspace& ws = state.workspace;
+    double* gradient = ws.gradient.data();
+    double* dU = ws.dU.data(); 
+    double* dU_ = ws.dU_.data(); 
+    double* dX_ = ws.dX_.data();
+    double* delta = ws.delta.data();
+    int* subproblem_iterations = ws.subproblem_iterations.data();
+    int* agent_gradients = ws.agent_gradients.data();
+    const bool jacobi = (solver_method == best_response_jacobi);
+
+    // Per-agent Hessian, dense or limited-memory in a slice of hessian_size doubles, kept across the sweeps:
+    const bool dense = (hessian_method == dense_sr1);
+    const int memory = std::min(std::max(memory_length, 1), (int) LimitedHessian::max_memory);
+    const int hessian_size = dense ? nu * nu : LimitedHessian::size(memory);
+    const typename LimitedHessian::UPDATES update = (hessian_method == limited_bfgs) ? LimitedHessian::BFGS : LimitedHessian::SR1;
+    ws.H_.resize(hessian_size * state.M);
+
+    // Best response of agent i on its own copy of the inputs and of the trajectories, fresh if gradient holds its 
+    // gradient at dU. The agents of the Jacobi sweep start from the frozen dU_ and leave their inputs in U_response, 
+    // dU is written once all of them are done:
+    double* U_response = ws.U_response.data();
+    auto best_response = [&](int i, bool fresh) {
+        double* U_i = ws.thread_scratch(thread_pool->thread_index());
+        double* X_i = U_i + state.nU_;
+        const double* U_start = jacobi ? dU_ : dU;
+        for (int j = 0; j < state.nU_; j++){
+            U_i[j] = U_start[j];
+        }
+        for (int j = 0; j < state.nX_; j++){
+            X_i[j] = dX_[j];
+        }
+        agent_gradients[i] = fresh ? 0 : 1;
+        if (dense){
+            Eigen::Map<HessianMatrix> H_i(&ws.H_[hessian_size * i]);
+            subproblem_iterations[i] = best_response_vehicle_i(state, X_i, U_i, &gradient[nu * i], fresh, H_i, delta[i], i);
+        }else{
+            LimitedHessian B_i(&ws.H_[hessian_size * i], memory, update);
+            subproblem_iterations[i] = best_response_vehicle_i(state, X_i, U_i, &gradient[nu * i], fresh, B_i, delta[i], i);
+        }
+        agent_gradients[i] += best_response_iterations;
+        if (jacobi){
+            for (int j = 0; j < nu; j++){
+                U_response[nu * i + j] = U_i[nu * i + j];
             }
-            if (U_[nU * (N + 1) * i + nU * j + d] > d_up){
-                U_[nU * (N + 1) * i + nU * j + d] = d_up;
+            return;
+        }
+
+        // The next agents of the Gauss-Seidel sweep see the new inputs and trajectory:
+        for (int j = 0; j < nu; j++){
+            dU[nu * i + j] = U_i[nu * i + j];
+        }
+        for (int j = 0; j < nx; j++){
+            dX_[nx * i + j] = X_i[nx * i + j];
+        }
+    };
+
+    // The projected gradient does not see the constraints, the solution must also be feasible:
+    auto max_constraint = [&](const double* constraints) {
+        double violation = 0.0;
+        for (int j = 0; j < state.nC; j++){
+            violation = std::max(violation, constraints[j]);
+        }
+        return violation;
+    };
+    double norm = std::numeric_limits<double>::infinity();
+    double violation;
+
+    // Deadline of the run, as in the trust region solver: a sweep starts only if the longest one so far fits in the 
+    // time left, the best iterate is returned at the deadline:
+    typedef std::chrono::steady_clock clock;
+    clock::time_point phase_start;
+    double gradient_time = state.gradient_time;
+    double sweep_time = 0.0;
+    double best_norm = std::numeric_limits<double>::infinity();
+    double best_violation = std::numeric_limits<double>::infinity();
+    bool deadline = false;
+    auto save_best = [&]() {
+        bool better = (violation <= threshold_constraints) ? (best_violation > threshold_constraints || norm < best_norm) 
+                                                           : (violation < best_violation);
+        if (better && state.time_budget > 0.0){
+            best_norm = norm;
+            best_violation = violation;
+            for (int i = 0; i < state.nU_; i++){
+                ws.U_best[i] = dU_[i];
             }
-            if (U_[nU * (N + 1) * i + nU * j + d] < d_low){
-                U_[nU * (N + 1) * i + nU * j + d] = d_low;
+        }
+    };
+
+    // Variables initialization, the inputs start within their bounds:
+    for (int i = 0; i < state.nU_; i++){
+        U_[i] = std::min(std::max(U_[i], state.ul(i % nu, 0)), state.uu(i % nu, 0));
+        dU_[i] = U_[i];
+    }
+    state.gradient_evaluations = 0;
+    state.agent_gradient_evaluations = 0;
+    state.subproblem_iterations = 0;
+    state.cache_hits = 0;
+    reset_evaluation_cache(state);
+    cached_integrate(state, dX_, dU_);
+    update_broad_phase(state, dX_);
+    for (int i = 0; i < state.M; i++){
+        delta[i] = 1.0;
+        if (dense){
+            Eigen::Map<HessianMatrix>(&ws.H_[hessian_size * i]).setIdentity();
+        }else{
+            LimitedHessian(&ws.H_[hessian_size * i], memory, update).reset();
+        }
+    }
+    compute_constraints(state, ws.tr_constraints.data(), dX_);
+    violation = max_constraint(ws.tr_constraints.data());
+
+    // Sweep loop:
+    while (true){
+
+        // Equilibrium residual of the current solution:
+        if (remaining_time(state) < gradient_time){
+            deadline = true;
+            break;
+        }
+        phase_start = clock::now();
+        cached_gradient(state, gradient, dU_);
+        gradient_time = std::max(gradient_time, std::chrono::duration<double>(clock::now() - phase_start).count());
+        norm = gradient_norm(state, gradient, dU_);
+        if (norm < threshold_gradient_norm && violation <= threshold_constraints){
+            convergence = true;
+        }
+        save_best();
+        if (convergence == true || iter >= iter_lim || (iter >= refine_lim && violation <= threshold_constraints)){
+            break;
+        }
+        if (remaining_time(state) < sweep_time){
+            deadline = true;
+            break;
+        }
+        clock::time_point sweep_start = clock::now();
+
+        // Best response of each agent:
+        if (jacobi){
+            if (state.M >= min_parallel_agents){
+                thread_pool->parallel_for(state.M, [&](int i) { best_response(i, true); });
+            }else{
+                for (int i = 0; i < state.M; i++){
+                    best_response(i, true);
+                }
             }
+            for (int i = 0; i < state.nU_; i++){
+                dU[i] = U_response[i];
+            }
+        }else{
+            for (int i = 0; i < state.nU_; i++){
+                dU[i] = dU_[i];
+            }
+            for (int i = 0; i < state.M; i++){
+                best_response(i, i == 0);
+            }
+        }
+        for (int i = 0; i < state.M; i++){
+            state.subproblem_iterations += subproblem_iterations[i];
+            state.agent_gradient_evaluations += agent_gradients[i];
+        }
+
+        // New state, collision pairs and constraints of the sweep (the buffers are sized by the broad phase):
+        for (int i = 0; i < state.nU_; i++){
+            dU_[i] = dU[i];
+        }
+        cached_integrate(state, dX_, dU_);
+        update_broad_phase(state, dX_);
+        double* constraints = ws.tr_constraints.data();
+        compute_constraints(state, constraints, dX_);
+        violation = max_constraint(constraints);
+
+        // Lagrangian multipliers and weight of the constraints for the next sweep:
+        compute_lagrangian_multipliers(state, ws.lagrangian_multipliers.data(), constraints);
+        save_lagrangian_multipliers(state, ws.lagrangian_multipliers.data());
+        increasing_schedule(state);
+        iter++;
+        sweep_time = std::max(sweep_time, std::chrono::duration<double>(clock::now() - sweep_start).count());
+    }
+
+    state.iterations = iter;
+    PROFILE(state.stats.rho = state.rho);
+    state.gradient_time = gradient_time;
+
+    // At the deadline the best iterate is returned:
+    state.status = convergence ? converged : (deadline ? deadline_reached : iteration_limit);
+    if (deadline){
+        norm = best_norm;
+        violation = best_violation;
+        for (int i = 0; i < state.nU_; i++){
+            dU_[i] = ws.U_best[i];
+        }
+    }
+    state.achieved_gradient_norm = norm;
+    state.constraint_violation = violation;
+
+    // Input of the last node:
+    correctionU(state, dU_);
+
+    // Save the solution:
+    for(int k = 0; k < state.nU_; k++){
+        U_[k] = dU_[k];
+    }
+}
+
+/** best response of vehicle i: best_response_iterations steps of the trust region on lagrangian_i with respect to U_i, 
+ * the trajectories of the other vehicles in X_ are frozen. U_ and X_ are copies owned by the agent, gradient_i is its 
+ * gradient at U_ if fresh. The steps use the Hessian H_ and the radius delta_i of the agent, the trust region works 
+ * on the collision pairs of the sweep. Returns the iterations of the subproblem solver */
+template <int N_>
+template <class Hessian>
+int DynamicGamePlanner<N_>::best_response_vehicle_i(const SolverState& state, double* X_, double* U_, double* gradient_i, bool fresh, Hessian & H_, double& delta_i, int i) const
+{
+    double eta = 1e-4;
+    double r_ = 1e-8;
+    int iterations = 0;
+    double* constraints_i = state.workspace.thread_scratch(thread_pool->thread_index()) + state.nU_ + state.nX_;
+    Eigen::Map<InputVector> u_(&U_[nu * i]);
+    Eigen::Map<InputVector> g_(gradient_i);
+    InputVector u_old;
+    InputVector d_g;
+    InputVector s_;
+    InputVector s_low;
+    InputVector s_up;
+    double lagrangian_i;
+    double d_lagrangian_i;
+    double actual_reduction;
+    double predicted_reduction;
+
+    // Lagrangian of vehicle i at U_, with its trajectory and constraints:
+    auto evaluate = [&]() {
+        integrate_vehicle_i(state, X_, U_, i, 0);
+        update_constraints_vehicle_i(state, constraints_i, X_, i, 0);
+        return compute_lagrangian_vehicle_i(state, compute_cost_vehicle_i(X_, U_, i), constraints_i, i);
+    };
+
+    lagrangian_i = evaluate();
+    if (!fresh){
+        compute_gradient_vehicle_i(state, gradient_i, X_, U_, constraints_i, lagrangian_i, i);
+    }
+    for (int k = 0; k < best_response_iterations; k++){
+
+        // Step within the input bounds:
+        s_low = state.ul.col(0) - u_;
+        s_up = state.uu.col(0) - u_;
+        {
+            PROFILE_AGENT_PHASE(state.stats, quadratic_problem_solver, i);
+            iterations += quadratic_problem_solver(s_, g_, H_, delta_i, s_low, s_up);
+        }
+        u_old = u_;
+        for (int j = 0; j < nu; j++){
+            u_(j) = std::min(std::max(u_old(j) + s_(j), state.ul(j, 0)), state.uu(j, 0));
+        }
+
+        // Lagrangian and gradient of the candidate:
+        d_lagrangian_i = evaluate();
+        compute_gradient_vehicle_i(state, d_g.data(), X_, U_, constraints_i, d_lagrangian_i, i);
+        actual_reduction = lagrangian_i - d_lagrangian_i;
+        InputVector Hs = H_ * s_;
+        predicted_reduction = - (g_.dot(s_) + 0.5 * s_.dot(Hs));
+
+        // Update of the radius as in the trust region solver:
+        if (actual_reduction / predicted_reduction > 0.75 && std::sqrt(s_.squaredNorm()) > 0.8 * delta_i){
+            delta_i = 2.0 * delta_i;
+        }
+        if (actual_reduction / predicted_reduction < 0.1){
+            delta_i = 0.5 * delta_i;
+        }
+        {
+            PROFILE_AGENT_PHASE(state.stats, hessian_update, i);
+            hessian_update(H_, s_, d_g - g_, r_);
+        }
+
+        // Accept or reject the step:
+        if (actual_reduction / predicted_reduction < eta){
+            u_ = u_old;
+            lagrangian_i = evaluate();
+            PROFILE(state.stats.rejected_steps[i]++);
+        }else{
+            lagrangian_i = d_lagrangian_i;
+            g_ = d_g;
+            PROFILE(state.stats.accepted_steps[i]++);
         }
     }
-}
\ No newline at end of file
+    return iterations;
+}
+
+/** the input of the last node does not act on the trajectory, it repeats the one of the previous node. The inputs are 
+ * already within their bounds */
+template <int N_>
+void DynamicGamePlanner<N_>::correctionU(const SolverState& state, double* U_) const
+{
+    for (int i = 0; i < state.M; i++){
+        U_[nU * (N + 1) * i + nU * N + d] = U_[nU * (N + 1) * i + nU * (N - 1) + d];
+        U_[nU * (N + 1) * i + nU * N + F] = U_[nU * (N + 1) * i + nU * (N - 1) + F];
+    }
+}
+
+template class DynamicGamePlanner<5>;
+template class DynamicGamePlanner<10>;
+template class DynamicGamePlanner<20>;
+template class DynamicGamePlanner<40>;
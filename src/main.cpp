@@ -95,7 +95,8 @@ int main() {
     }
 
     // Run the planner
-    DynamicGamePlanner planner;
+    DynamicGamePlanner<20> planner;
+    planner.diagnostics = std::make_shared<TextDiagnostics>();   // iterations, trajectories and violations on std::cerr
 
     auto start_time = std::chrono::high_resolution_clock::now();
 
@@ -108,8 +109,6 @@ int main() {
 
     std::cout << "Execution Time for run(): " << elapsed_time.count() << " ms" << std::endl;
 
-    traffic_intersection = planner.traffic;
-
     // Save trajectories to a CSV file
     save_trajectories_to_csv(traffic_intersection, "../trajectories_intersection.csv");
     save_lanes_to_csv(traffic_intersection, "../lanes_intersection.csv");
@@ -169,8 +168,6 @@ int main() {
 
     std::cout << "Execution Time for run(): " << elapsed_time.count() << " ms" << std::endl;
 
-    traffic_merging = planner.traffic;
-
     // Save trajectories to a CSV file
     save_trajectories_to_csv(traffic_merging, "../trajectories_merging.csv");
     save_lanes_to_csv(traffic_merging, "../lanes_merging.csv");
@@ -234,8 +231,6 @@ int main() {
 
     std::cout << "Execution Time for run(): " << elapsed_time.count() << " ms" << std::endl;
 
-    traffic_overtaking = planner.traffic;
-
     // Save trajectories to a CSV file
     save_trajectories_to_csv(traffic_overtaking, "../trajectories_overtaking.csv");
     save_lanes_to_csv(traffic_overtaking, "../lanes_overtaking.csv");
@@ -0,0 +1,145 @@
+#include "thread_pool.h"
+
+namespace {
+thread_local const ThreadPool* current_pool = nullptr;     /** pool owning the calling thread */
+thread_local int current_index = 0;                        /** index of the calling thread in its pool */
+}
+
+/** the calling thread of parallel_for is also a worker, so num_threads - 1 threads are created */
+ThreadPool::ThreadPool(int num_threads) : sequence(0), stop(false)
+{
+    for (int i = 0; i < num_threads - 1; i++){
+        workers.emplace_back(&ThreadPool::worker_loop, this, i + 1);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    job_available.notify_all();
+    for (auto& worker : workers){
+        worker.join();
+    }
+}
+
+int ThreadPool::size() const
+{
+    return workers.size() + 1;
+}
+
+/** index of the calling thread, used to give each thread its own scratch memory. Threads outside the pool get 0: 
+ * the thread that calls parallel_for takes part in the job as thread 0 */
+int ThreadPool::thread_index() const
+{
+    return (current_pool == this) ? current_index : 0;
+}
+
+/** runs task(0) ... task(num_tasks - 1) on the pool and returns when all of them are completed */
+void ThreadPool::parallel_for(int num_tasks, const std::function<void(int)>& task)
+{
+    if (num_tasks <= 0){
+        return;
+    }
+
+    // Nothing to share: run on the calling thread
+    if (workers.empty() || num_tasks == 1){
+        for (int i = 0; i < num_tasks; i++){
+            task(i);
+        }
+        return;
+    }
+
+    auto job = std::make_shared<Job>();
+    job->task = &task;
+    job->num_tasks = num_tasks;
+    job->next = 0;
+    job->done = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job->sequence = sequence++;
+        jobs.push_back(job);
+    }
+    job_available.notify_all();
+    job_finished.notify_all();
+
+    // The calling thread works on its own job:
+    while (run_one(*job)){}
+    remove_job(job);
+
+    // Wait for the tasks still running on the workers. A worker of the pool helps the jobs queued after its own one 
+    // meanwhile: they are nested in the tasks running on the other threads, so their tasks never share the thread 
+    // index of this one. Other threads only wait, their index 0 can be in use by the caller of any job:
+    std::unique_lock<std::mutex> lock(mutex);
+    while (job->done.load() < num_tasks){
+        std::shared_ptr<Job> other = (current_pool == this) ? job_after(job->sequence) : nullptr;
+        if (other){
+            lock.unlock();
+            if (!run_one(*other)){
+                remove_job(other);
+            }
+            lock.lock();
+        }else{
+            job_finished.wait(lock);
+        }
+    }
+}
+
+/** claims and runs one task of the job, returns false if all the tasks are already claimed */
+bool ThreadPool::run_one(Job& job)
+{
+    int index = job.next.fetch_add(1);
+    if (index >= job.num_tasks){
+        return false;
+    }
+    (*job.task)(index);
+    if (job.done.fetch_add(1) + 1 == job.num_tasks){
+        std::lock_guard<std::mutex> lock(mutex);
+        job_finished.notify_all();
+    }
+    return true;
+}
+
+void ThreadPool::remove_job(const std::shared_ptr<Job>& job)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = jobs.begin(); it != jobs.end(); ++it){
+        if (*it == job){
+            jobs.erase(it);
+            break;
+        }
+    }
+}
+
+std::shared_ptr<ThreadPool::Job> ThreadPool::job_after(long sequence_)
+{
+    for (const std::shared_ptr<Job>& job : jobs){
+        if (job->sequence > sequence_ && job->next.load() < job->num_tasks){
+            return job;
+        }
+    }
+    return nullptr;
+}
+
+void ThreadPool::worker_loop(int index)
+{
+    std::shared_ptr<Job> job;
+    current_pool = this;
+    current_index = index;
+    while (true){
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_available.wait(lock, [&]{ return stop || !jobs.empty(); });
+            if (stop){
+                return;
+            }
+            job = jobs.front();
+        }
+        if (!run_one(*job)){
+            remove_job(job);
+        }
+        job.reset();
+    }
+}
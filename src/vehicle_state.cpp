@@ -8,13 +8,25 @@ void Lane::initialize_spline(const std::vector<double>& x,
         spline_y.set_points(s, y);  // Set y-coordinate spline
         s_max = s.back();           // Store the last progress value
         present = true;
+
+        // Lookup table sampled uniformly in s:
+        int n_samples = (int) std::ceil((s.back() - s.front()) / ds_table) + 1;
+        s_table = s.front();
+        size_t cursor_x = 0;
+        size_t cursor_y = 0;
+        table.resize(4 * n_samples);
+        for (int n = 0; n < n_samples; n++){
+            double s_n = s_table + n * ds_table;
+            spline_x.eval_cursor(s_n, cursor_x, &table[4 * n + 0], &table[4 * n + 2]);
+            spline_y.eval_cursor(s_n, cursor_y, &table[4 * n + 1], &table[4 * n + 3]);
+        }
     } else {
         present = false;  // Not enough points to create a spline
     }
 }
 
 /** computes the heading on the spline x(s) and y(s) at parameter s*/
-double Lane::compute_heading(double s)
+double Lane::compute_heading(double s) const
 {
     double psi;
     double dx = spline_x.deriv(1, s);
@@ -25,13 +37,17 @@ double Lane::compute_heading(double s)
 }
 
 /** computes the curvature on the spline x(t) and y(t) at time t*/
-double Lane::compute_curvature(double s)
+double Lane::compute_curvature(double s) const
 {
     double k;
-    double dx = spline_x.deriv(1, s);
-    double dy = spline_y.deriv(1, s);
-    double ddx = spline_x.deriv(2, s);
-    double ddy = spline_y.deriv(2, s);
+    double dx;
+    double dy;
+    double ddx;
+    double ddy;
+    size_t cursor_x = 0;
+    size_t cursor_y = 0;
+    spline_x.eval_cursor(s, cursor_x, NULL, &dx, &ddx);
+    spline_y.eval_cursor(s, cursor_y, NULL, &dy, &ddy);
     k = (ddy * dx - ddx * dy) / sqrt((dx * dx + dy * dy) * (dx * dx + dy * dy) * (dx * dx + dy * dy));
     return k;
 }
\ No newline at end of file
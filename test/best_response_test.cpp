@@ -0,0 +1,28 @@
+#include "dynamic_game_planner.h"
+#include "scenarios.h"
+#include <iostream>
+#include <cmath>
+
+/** Checks that the Jacobi and Gauss-Seidel best responses reach a feasible solution of the intersection scenario 
+ * and report its equilibrium residual */
+
+typedef DynamicGamePlanner<20> Planner;
+
+int main() {
+    const double threshold_constraints = 1e-2;
+    Planner planner(std::make_shared<ThreadPool>(2));
+    int failures = 0;
+
+    for (Planner::SOLVER_METHODS solver_method : {Planner::best_response_jacobi, Planner::best_response_gauss_seidel}){
+        planner.solver_method = solver_method;
+        TrafficParticipants traffic = intersection_scenario();
+        SolverState state;
+        planner.run(traffic, state);
+        std::cerr << "solver " << solver_method << ": " << state.iterations << " sweeps, residual " 
+                  << state.achieved_gradient_norm << ", violation " << state.constraint_violation << "\n";
+        failures += !(state.constraint_violation <= threshold_constraints);
+        failures += !(std::isfinite(state.achieved_gradient_norm) && state.achieved_gradient_norm > 0.0);
+        failures += (state.agent_gradient_evaluations <= 0);
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,41 @@
+#include "dynamic_game_planner.h"
+#include "scenarios.h"
+#include <iostream>
+
+/** Checks that two clusters of vehicles far apart, solved as separate games, get the solution of the whole game. 
+ * The separate games can stop on their own residual and round differently, so the solutions agree within a 
+ * tolerance */
+
+typedef DynamicGamePlanner<20> Planner;
+
+int main() {
+    const double tolerance = 1e-5;
+    Planner planner(std::make_shared<ThreadPool>(4));
+    std::vector<double> U[2];
+    int failures = 0;
+
+    for (int decompose = 0; decompose < 2; decompose++){
+        TrafficParticipants traffic = intersection_scenario();
+        TrafficParticipants far = ring_scenario(4);
+        for (VehicleState& vehicle : far){
+            vehicle.x += 1000.0;
+            vehicle.id += traffic.size();
+            straight_centerlane(vehicle, 30);
+        }
+        traffic.insert(traffic.end(), far.begin(), far.end());
+
+        planner.decompose_interactions = (decompose == 1);
+        SolverState state;
+        planner.run(traffic, state);
+        U[decompose] = state.workspace.U;
+        failures += (state.components.size() != (decompose == 1 ? 2u : 0u));
+    }
+
+    double difference = 0.0;
+    for (size_t k = 0; k < U[0].size(); k++){
+        difference = std::max(difference, std::abs(U[0][k] - U[1][k]));
+    }
+    std::cerr << "largest difference of the inputs " << difference << "\n";
+    failures += !(difference <= tolerance);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,84 @@
+#include "dynamic_game_planner.h"
+#include <iostream>
+#include <cmath>
+
+/** Checks the adjoint gradient against the finite differences on the intersection scenario, at the initial guess 
+ * and at the solution of a run, where the lagrangian multipliers and the collision constraints are active */
+
+// Intersection scenario of main.cpp: 3 vehicles approaching an intersection
+TrafficParticipants intersection_scenario() {
+    TrafficParticipants traffic = {
+        // x, y, v, psi, beta, a, v_target
+        {0.0, 0.0, 5.0, 0.0, 0.0, 0.0, 10.0},
+        {10.0, -10.0, 5.0, 1.57, 0.0, 0.0, 10.0},
+        {20.0, 20.0, 0.0, -1.57, 0.0, 0.0, 10.0}
+    };
+    for (size_t i = 0; i < traffic.size(); i++) {
+        std::vector<double> x_vals, y_vals, s_vals;
+        for (int j = 0; j < 50; j++) {
+            if (i == 0) {
+                x_vals.push_back(traffic[i].x + j * 5.0);
+                y_vals.push_back(traffic[i].y);
+            } else if (i == 1) {
+                x_vals.push_back(traffic[i].x);
+                y_vals.push_back(traffic[i].y + j * 5.0);
+            } else {
+                x_vals.push_back(traffic[i].x);
+                y_vals.push_back(traffic[i].y - j * 5.0);
+            }
+            s_vals.push_back(j * 5.0);
+        }
+        traffic[i].centerlane.initialize_spline(x_vals, y_vals, s_vals);
+    }
+    return traffic;
+}
+
+// Largest difference of the two gradients relative to the largest component of the finite differences:
+double compare_gradients(DynamicGamePlanner<20>& planner, const SolverState& state, const double* U) {
+    std::vector<double> gradient_fd(state.nG);
+    std::vector<double> gradient_adjoint(state.nG);
+    planner.gradient_method = DynamicGamePlanner<20>::finite_differences;
+    planner.compute_gradient(state, gradient_fd.data(), U);
+    planner.gradient_method = DynamicGamePlanner<20>::adjoint;
+    planner.compute_gradient(state, gradient_adjoint.data(), U);
+
+    double scale = 1.0;
+    double error = 0.0;
+    for (int n = 0; n < state.nG; n++){
+        scale = std::max(scale, std::abs(gradient_fd[n]));
+    }
+    for (int n = 0; n < state.nG; n++){
+        error = std::max(error, std::abs(gradient_adjoint[n] - gradient_fd[n]));
+    }
+    return error / scale;
+}
+
+int main() {
+    const double tolerance = 1e-4;
+    DynamicGamePlanner<20> planner(std::make_shared<ThreadPool>(2));
+    TrafficParticipants traffic = intersection_scenario();
+    SolverState state;
+    int failures = 0;
+
+    // Initial guess, without multipliers:
+    for (const VehicleState& vehicle : traffic){
+        state.traffic.push_back(&vehicle);
+    }
+    planner.setup(state);
+    std::vector<double> U(state.nU_);
+    std::vector<double> X(state.nX_);
+    planner.initial_guess(state, X.data(), U.data());
+    planner.update_broad_phase(state, X.data());
+    double error = compare_gradients(planner, state, U.data());
+    std::cerr << "initial guess: relative error " << error << "\n";
+    failures += (error > tolerance);
+
+    // Solution of a run, with the multipliers and the collision blocks of its last iteration:
+    planner.run(traffic, state);
+    U = state.workspace.U;
+    error = compare_gradients(planner, state, U.data());
+    std::cerr << "solution: relative error " << error << "\n";
+    failures += (error > tolerance);
+
+    return failures == 0 ? 0 : 1;
+}
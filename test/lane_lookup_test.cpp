@@ -0,0 +1,42 @@
+#include "vehicle_state.h"
+#include <iostream>
+#include <cmath>
+
+/** Checks the lookup table of a lane against its splines on a curve of 5 m radius, with the knots of the splines 
+ * off the samples of the table: the position within 3e-5 m and the heading within 3e-4 rad */
+
+int main() {
+    const double tolerance_position = 3e-5;
+    const double tolerance_heading = 3e-4;
+    const double radius = 5.0;
+    const double ds_knots = 1.3;                            // not a multiple of ds_table
+
+    // Three quarters of a circle, then the lane goes on straight:
+    Lane lane;
+    std::vector<double> x_vals, y_vals, s_vals;
+    for (int j = 0; j * ds_knots < 1.5 * M_PI * radius + 20.0; j++) {
+        double s = j * ds_knots;
+        double a = std::min(s, 1.5 * M_PI * radius) / radius;
+        double straight = std::max(s - 1.5 * M_PI * radius, 0.0);
+        x_vals.push_back(radius * std::sin(a) + straight * std::cos(a));
+        y_vals.push_back(radius * (1.0 - std::cos(a)) + straight * std::sin(a));
+        s_vals.push_back(s);
+    }
+    lane.initialize_spline(x_vals, y_vals, s_vals);
+
+    double error_position = 0.0;
+    double error_heading = 0.0;
+    double x, y, cos_psi, sin_psi;
+    for (double s = 0.0; s <= lane.s_max; s += 0.01) {
+        lane.lookup(s, x, y, cos_psi, sin_psi);
+        double dx = x - lane.spline_x(s);
+        double dy = y - lane.spline_y(s);
+        double dpsi = std::atan2(sin_psi, cos_psi) - lane.compute_heading(s);
+        dpsi = std::remainder(dpsi, 2.0 * M_PI);
+        error_position = std::max(error_position, std::sqrt(dx * dx + dy * dy));
+        error_heading = std::max(error_heading, std::abs(dpsi));
+    }
+    std::cerr << "position error " << error_position << " m, heading error " << error_heading << " rad\n";
+
+    return (error_position <= tolerance_position && error_heading <= tolerance_heading) ? 0 : 1;
+}
@@ -0,0 +1,82 @@
+#include "dynamic_game_planner.h"
+#include <iostream>
+#include <random>
+
+/** Checks the limited-memory Hessians on pairs of a quadratic with a fixed positive definite Hessian A: with all 
+ * the pairs in memory the SR1 one equals the dense SR1 update of the identity, and the last pair satisfies the 
+ * secant condition B * s = y, also once the memory is full and the oldest pairs are dropped */
+
+typedef DynamicGamePlanner<20> Planner;
+typedef Planner::LimitedHessian LimitedHessian;
+typedef Planner::InputVector InputVector;
+typedef Planner::HessianMatrix HessianMatrix;
+
+const double r_ = 1e-8;
+
+// Relative error of the secant condition for the pair (s_, y_):
+double secant_error(const LimitedHessian& B, const InputVector& s_, const InputVector& y_) {
+    return (B * s_ - y_).norm() / y_.norm();
+}
+
+int main() {
+    const int n = Planner::nu;
+    const double tolerance = 1e-8;
+    std::mt19937 generator(7);
+    std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+    auto random_vector = [&]() {
+        InputVector v;
+        for (int j = 0; j < n; j++){
+            v(j) = uniform(generator);
+        }
+        return v;
+    };
+    HessianMatrix R;
+    for (int j = 0; j < n; j++){
+        R.col(j) = random_vector();
+    }
+    const HessianMatrix A = R * R.transpose() / n + HessianMatrix::Identity();
+    Planner planner(std::make_shared<ThreadPool>(1));
+    int failures = 0;
+
+    // SR1 with all the pairs in memory against the dense SR1 update:
+    {
+        const int memory = 10;
+        std::vector<double> storage(LimitedHessian::size(memory));
+        LimitedHessian B(storage.data(), memory, LimitedHessian::SR1);
+        B.reset();
+        HessianMatrix H = HessianMatrix::Identity();
+        for (int k = 0; k < 6; k++){
+            InputVector s_ = random_vector();
+            InputVector y_ = A * s_;
+            planner.hessian_SR1_update(H, s_, y_, r_);
+            B.update(s_, y_, r_);
+        }
+        double error = 0.0;
+        for (int k = 0; k < 5; k++){
+            InputVector v = random_vector();
+            error = std::max(error, (B * v - H * v).norm() / (H * v).norm());
+        }
+        std::cerr << "SR1 against dense: relative error " << error << "\n";
+        failures += (B.pairs() != 6 || !(error < tolerance));
+    }
+
+    // Secant condition of the last pair, with the memory full:
+    for (LimitedHessian::UPDATES update : {LimitedHessian::SR1, LimitedHessian::BFGS}){
+        const int memory = 4;
+        std::vector<double> storage(LimitedHessian::size(memory));
+        LimitedHessian B(storage.data(), memory, update);
+        B.reset();
+        double error = 0.0;
+        for (int k = 0; k < 3 * memory; k++){
+            InputVector s_ = random_vector();
+            InputVector y_ = A * s_;
+            failures += !B.update(s_, y_, r_);
+            error = std::max(error, secant_error(B, s_, y_));
+        }
+        std::cerr << ((update == LimitedHessian::SR1) ? "SR1" : "BFGS") << " secant condition: relative error " 
+                  << error << ", pairs " << B.pairs() << "\n";
+        failures += (B.pairs() < 1 || B.pairs() > memory || !(error < tolerance));
+    }
+
+    return failures == 0 ? 0 : 1;
+}
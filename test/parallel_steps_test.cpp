@@ -0,0 +1,30 @@
+#include "dynamic_game_planner.h"
+#include "scenarios.h"
+#include <iostream>
+#include <climits>
+
+/** Checks that the steps of the agents computed in parallel give the same solution, bit for bit, as the serial 
+ * steps, for the trust region and the Jacobi best response on a ring of 8 vehicles */
+
+typedef DynamicGamePlanner<20> Planner;
+
+// Solution of the ring with the steps of the agents in parallel from min_parallel_agents:
+std::vector<double> solve_ring(Planner::SOLVER_METHODS solver_method, int min_parallel_agents) {
+    Planner planner(std::make_shared<ThreadPool>(4));
+    planner.solver_method = solver_method;
+    planner.min_parallel_agents = min_parallel_agents;
+    TrafficParticipants traffic = ring_scenario(8);
+    SolverState state;
+    planner.run(traffic, state);
+    return state.workspace.U;
+}
+
+int main() {
+    int failures = 0;
+    for (Planner::SOLVER_METHODS solver_method : {Planner::trust_region, Planner::best_response_jacobi}) {
+        bool identical = solve_ring(solver_method, 1) == solve_ring(solver_method, INT_MAX);
+        std::cerr << "solver " << solver_method << ": " << (identical ? "identical" : "different") << "\n";
+        failures += !identical;
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,48 @@
+#include "dynamic_game_planner.h"
+#include "scenarios.h"
+#include <iostream>
+
+/** Built with PLANNER_PROFILING: checks that the phases, counters and steps of a run are collected, for a single 
+ * game and for two separate games merged in one run */
+
+typedef DynamicGamePlanner<20> Planner;
+
+// Phases and counters every run goes through:
+int check_stats(const SolverState& state) {
+    const SolverStats& stats = state.stats;
+    int failures = 0;
+    for (int p : {SolverStats::integrate, SolverStats::compute_gradient, SolverStats::compute_constraints, 
+                  SolverStats::quadratic_problem_solver, SolverStats::hessian_update}){
+        failures += (stats.calls[p] <= 0 || stats.time[p] < 0.0);
+    }
+    failures += (stats.rollouts <= 0);
+    failures += ((int) stats.accepted_steps.size() != state.M || (int) stats.rejected_steps.size() != state.M);
+    for (int i = 0; i < state.M; i++){
+        failures += (stats.accepted_steps[i] + stats.rejected_steps[i] <= 0);
+    }
+    failures += (stats.rho <= 0.0);
+    return failures;
+}
+
+int main() {
+    Planner planner(std::make_shared<ThreadPool>(2));
+    int failures = 0;
+
+    // One game:
+    TrafficParticipants traffic = intersection_scenario();
+    SolverState state;
+    planner.run(traffic, state);
+    failures += check_stats(state);
+
+    // Two intersections far apart, solved as separate games:
+    traffic = intersection_scenario();
+    TrafficParticipants far = intersection_scenario(1000.0, 3);
+    traffic.insert(traffic.end(), far.begin(), far.end());
+    planner.run(traffic, state);
+    failures += (state.components.size() != 2);
+    failures += check_stats(state);
+
+    std::cerr << "gradient calls " << state.stats.calls[SolverStats::compute_gradient] 
+              << ", rollouts " << state.stats.rollouts << ", failures " << failures << "\n";
+    return failures == 0 ? 0 : 1;
+}
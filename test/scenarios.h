@@ -0,0 +1,45 @@
+#ifndef TEST_SCENARIOS_H
+#define TEST_SCENARIOS_H
+
+#include "vehicle_state.h"
+#include <cmath>
+
+/** Scenarios shared by the tests */
+
+// Straight center lane of a vehicle along its heading:
+inline void straight_centerlane(VehicleState& vehicle, int length = 50, double spacing = 5.0) {
+    std::vector<double> x_vals, y_vals, s_vals;
+    for (int j = 0; j < length; j++) {
+        x_vals.push_back(vehicle.x + j * spacing * std::cos(vehicle.psi));
+        y_vals.push_back(vehicle.y + j * spacing * std::sin(vehicle.psi));
+        s_vals.push_back(j * spacing);
+    }
+    vehicle.centerlane.initialize_spline(x_vals, y_vals, s_vals);
+}
+
+// Intersection scenario of main.cpp: 3 vehicles approaching an intersection
+inline TrafficParticipants intersection_scenario(double x0 = 0.0, int id0 = 0) {
+    TrafficParticipants traffic = {
+        // x, y, v, psi, beta, a, v_target, id
+        {x0 + 0.0, 0.0, 5.0, 0.0, 0.0, 0.0, 10.0, id0},
+        {x0 + 10.0, -10.0, 5.0, M_PI / 2, 0.0, 0.0, 10.0, id0 + 1},
+        {x0 + 20.0, 20.0, 0.0, - M_PI / 2, 0.0, 0.0, 10.0, id0 + 2}
+    };
+    for (VehicleState& vehicle : traffic) {
+        straight_centerlane(vehicle);
+    }
+    return traffic;
+}
+
+// M vehicles on a circle of 25 m radius driving towards its center, all of them interact:
+inline TrafficParticipants ring_scenario(int M) {
+    TrafficParticipants traffic;
+    for (int i = 0; i < M; i++) {
+        double a = 2.0 * M_PI * i / M;
+        traffic.emplace_back(25.0 * std::cos(a), 25.0 * std::sin(a), 5.0, a + M_PI, 0.0, 0.0, 10.0, i);
+        straight_centerlane(traffic.back(), 30);
+    }
+    return traffic;
+}
+
+#endif // TEST_SCENARIOS_H
@@ -0,0 +1,47 @@
+#include "dynamic_game_planner.h"
+#include "scenarios.h"
+#include <iostream>
+
+/** Checks that solve_batch gives each scene the same predictions as a run of the scene on its own */
+
+typedef DynamicGamePlanner<20> Planner;
+
+// Largest difference between the predictions of two solutions of a scene:
+double prediction_difference(const TrafficParticipants& a, const TrafficParticipants& b) {
+    double difference = 0.0;
+    for (size_t i = 0; i < a.size(); i++){
+        for (size_t j = 0; j < a[i].predicted_trajectory.size(); j++){
+            const TrajectoryPoint& p = a[i].predicted_trajectory[j];
+            const TrajectoryPoint& q = b[i].predicted_trajectory[j];
+            difference = std::max({difference, std::abs(p.x - q.x), std::abs(p.y - q.y), std::abs(p.v - q.v), std::abs(p.psi - q.psi)});
+            difference = std::max(difference, std::abs(a[i].predicted_control[j].delta - b[i].predicted_control[j].delta));
+        }
+    }
+    return difference;
+}
+
+int main() {
+    Planner planner(std::make_shared<ThreadPool>(4));
+    int failures = 0;
+
+    // Scenes of different sizes, one of them with two separate games:
+    std::vector<TrafficParticipants> scenes = {intersection_scenario(), ring_scenario(4), ring_scenario(8), intersection_scenario()};
+    TrafficParticipants two_intersections = intersection_scenario();
+    TrafficParticipants far = intersection_scenario(1000.0, 3);
+    two_intersections.insert(two_intersections.end(), far.begin(), far.end());
+    scenes.push_back(two_intersections);
+
+    std::vector<TrafficParticipants> sequential = scenes;
+    std::vector<SceneResult> results;
+    planner.solve_batch(scenes.data(), scenes.size(), results);
+
+    for (size_t n = 0; n < scenes.size(); n++){
+        SolverState state;
+        planner.run(sequential[n], state);
+        double difference = prediction_difference(scenes[n], sequential[n]);
+        bool same = (difference == 0.0 && results[n].iterations == state.iterations && results[n].status == state.status);
+        std::cerr << "scene " << n << ": " << scenes[n].size() << " vehicles, difference " << difference << "\n";
+        failures += !same;
+    }
+    return failures == 0 ? 0 : 1;
+}
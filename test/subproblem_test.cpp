@@ -0,0 +1,75 @@
+#include "dynamic_game_planner.h"
+#include <iostream>
+#include <random>
+
+/** Checks the engines of the trust region subproblem on fixed Hessians, positive definite and indefinite, and fixed 
+ * gradients with active bounds: the steps stay in the trust region and in the box, and the dogleg and conjugate 
+ * gradient steps never have a model above the one of the generalized Cauchy point */
+
+typedef DynamicGamePlanner<20> Planner;
+typedef Planner::InputVector InputVector;
+typedef Planner::HessianMatrix HessianMatrix;
+
+double model(const InputVector& s_, const InputVector& G_, const HessianMatrix& H_) {
+    return G_.dot(s_) + 0.5 * s_.dot(H_ * s_);
+}
+
+int main() {
+    const int n = Planner::nu;
+    const double tolerance = 1e-10;
+    std::mt19937 generator(11);
+    std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+    auto random_vector = [&]() {
+        InputVector v;
+        for (int j = 0; j < n; j++){
+            v(j) = uniform(generator);
+        }
+        return v;
+    };
+    Planner planner(std::make_shared<ThreadPool>(1));
+    int failures = 0;
+    int cases = 0;
+
+    for (int c = 0; c < 20; c++){
+        HessianMatrix R;
+        for (int j = 0; j < n; j++){
+            R.col(j) = random_vector();
+        }
+        HessianMatrix H = R * R.transpose() / n + 0.1 * HessianMatrix::Identity();
+        if (c % 2 == 1){
+            H -= 0.5 * HessianMatrix::Identity();            // indefinite
+        }
+        InputVector G = 5.0 * random_vector();
+
+        // Box around the current inputs, a quarter of them at a bound:
+        InputVector s_low = - 0.5 * (random_vector().array() + 1.5).matrix();
+        InputVector s_up = 0.5 * (random_vector().array() + 1.5).matrix();
+        for (int j = 0; j < n; j += 4){
+            if (G(j) > 0.0){
+                s_low(j) = 0.0;
+            }else{
+                s_up(j) = 0.0;
+            }
+        }
+        const double Delta = (c % 4 < 2) ? 0.5 : 10.0;
+
+        InputVector s_[3];
+        const Planner::SUBPROBLEM_METHODS methods[3] = {Planner::cauchy_point, Planner::dogleg, Planner::steihaug_cg};
+        for (int m = 0; m < 3; m++){
+            planner.subproblem_method = methods[m];
+            planner.quadratic_problem_solver(s_[m], G, H, Delta, s_low, s_up);
+            bool inside = s_[m].norm() <= Delta * (1.0 + tolerance) 
+                          && (s_[m] - s_low).minCoeff() >= - tolerance && (s_up - s_[m]).minCoeff() >= - tolerance;
+            bool descent = (m == 0) ? model(s_[0], G, H) < 0.0 
+                                    : model(s_[m], G, H) <= model(s_[0], G, H) + tolerance;
+            if (!inside || !descent){
+                std::cerr << "case " << c << ", method " << methods[m] << ": norm " << s_[m].norm() << " (Delta " << Delta 
+                          << "), model " << model(s_[m], G, H) << " (Cauchy point " << model(s_[0], G, H) << ")\n";
+                failures++;
+            }
+            cases++;
+        }
+    }
+    std::cerr << cases << " steps, " << failures << " failures\n";
+    return failures == 0 ? 0 : 1;
+}